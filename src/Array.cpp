@@ -1,6 +1,9 @@
 #include <iostream> // DEBUG
+#include <algorithm>
 #include <stdexcept>
+#include <cassert>
 #include <cstring>
+#include <thread>
 #include "Array.hpp"
 #include "DebugHelper.hpp"
 #include "CowBuildConfig.hpp"
@@ -43,7 +46,7 @@ HeapAllocation::HeapAllocation() : numberOfBytes (0)
 
 HeapAllocation::~HeapAllocation()
 {
-    std::free (allocation);
+    release();
 }
 
 HeapAllocation::HeapAllocation (std::size_t numberOfBytes) : numberOfBytes (numberOfBytes)
@@ -70,12 +73,22 @@ HeapAllocation::HeapAllocation (std::string content) : numberOfBytes (content.si
     std::memcpy (allocation, content.data(), numberOfBytes);
 }
 
+HeapAllocation::HeapAllocation (void* memory, std::size_t numberOfBytes, std::function<void (void*)> deallocate) :
+allocation (memory),
+numberOfBytes (numberOfBytes),
+deallocate (deallocate)
+{
+
+}
+
 HeapAllocation::HeapAllocation (HeapAllocation&& other)
 {
     allocation = other.allocation;
     numberOfBytes = other.numberOfBytes;
+    deallocate = std::move (other.deallocate);
     other.allocation = nullptr;
     other.numberOfBytes = 0;
+    other.deallocate = nullptr;
 }
 
 HeapAllocation& HeapAllocation::operator= (const HeapAllocation& other)
@@ -84,8 +97,15 @@ HeapAllocation& HeapAllocation::operator= (const HeapAllocation& other)
     {
         if (numberOfBytes != other.numberOfBytes)
         {
+            if (deallocate)
+            {
+                // The block may be an MPI window, which is freed collectively
+                // and must not be swapped for ordinary heap memory.
+                throw std::logic_error ("cannot copy-assign a block of a different size into memory with a custom deallocator");
+            }
+            release();
             numberOfBytes = other.numberOfBytes;
-            allocation = std::realloc (allocation, numberOfBytes);
+            allocation = std::malloc (numberOfBytes);
         }
         std::memcpy (allocation, other.allocation, numberOfBytes);
     }
@@ -96,15 +116,31 @@ HeapAllocation& HeapAllocation::operator= (HeapAllocation&& other)
 {
     if (&other != this)
     {
-        std::free (allocation);
+        release();
         allocation = other.allocation;
         numberOfBytes = other.numberOfBytes;
+        deallocate = std::move (other.deallocate);
         other.allocation = nullptr;
         other.numberOfBytes = 0;
+        other.deallocate = nullptr;
     }
     return *this;
 }
 
+void HeapAllocation::release()
+{
+    if (deallocate)
+    {
+        deallocate (allocation);
+        deallocate = nullptr;
+    }
+    else
+    {
+        std::free (allocation);
+    }
+    allocation = nullptr;
+}
+
 std::size_t HeapAllocation::size() const
 {
     return numberOfBytes;
@@ -503,6 +539,23 @@ memory (n1 * n2 * n3 * n4 * n5 * sizeof (double))
     S[4] = 1;
 }
 
+Array Array::uninitialized (Shape shape)
+{
+    auto A = Array();
+    A.n1 = shape[0];
+    A.n2 = shape[1];
+    A.n3 = shape[2];
+    A.n4 = shape[3];
+    A.n5 = shape[4];
+    A.memory = HeapAllocation (A.size() * sizeof (double));
+    A.S[0] = A.n5 * A.n4 * A.n3 * A.n2;
+    A.S[1] = A.n5 * A.n4 * A.n3;
+    A.S[2] = A.n5 * A.n4;
+    A.S[3] = A.n5;
+    A.S[4] = 1;
+    return A;
+}
+
 Array::Array (const Array& other)
 {
     memory = other.memory;
@@ -785,6 +838,126 @@ void Array::copyRegion (Array& dst, const Array& src, Region R1, Region R0)
     }
 }
 
+void Array::packRegion (Region R, double* buffer, int numThreads) const
+{
+    R.ensureAbsolute (shape());
+    auto data = const_cast<double*> (static_cast<const double*> (memory.begin()));
+    copyRegionBuffer (data, shape(), S, R, buffer, true, numThreads);
+}
+
+void Array::unpackRegion (Region R, const double* buffer, int numThreads)
+{
+    R.ensureAbsolute (shape());
+    copyRegionBuffer (begin(), shape(), S, R, const_cast<double*> (buffer), false, numThreads);
+}
+
+void Array::copyRegionBuffer (double* array, Shape extent, Shape S, Region R, double* buffer, bool toBuffer, int numThreads)
+{
+    auto count = R.shape();
+
+    if (R.size() == 0)
+    {
+        return;
+    }
+
+    // Trailing axes that the region covers completely, with unit stride, are
+    // contiguous in memory along with the first axis inside of them that has
+    // unit stride. Find the number of elements in that contiguous run, and
+    // the last axis which must be looped over.
+
+    int axis = 4;
+    int run = 1;
+
+    while (axis > 0 && R.lower[axis] == 0 && R.upper[axis] == extent[axis] && R.stride[axis] == 1)
+    {
+        run *= count[axis];
+        --axis;
+    }
+    if (R.stride[axis] == 1)
+    {
+        run *= count[axis];
+        --axis;
+    }
+
+    int numRuns = 1;
+    int baseOffset = 0;
+
+    for (int n = 0; n < 5; ++n)
+    {
+        baseOffset += R.lower[n] * S[n];
+    }
+    for (int n = 0; n <= axis; ++n)
+    {
+        numRuns *= count[n];
+    }
+
+    auto copyRuns = [&] (int firstRun, int lastRun)
+    {
+        // Unravel the first run's multi-index, then advance it like an
+        // odometer to avoid a division for every run.
+        auto index = Index {{ 0, 0, 0, 0, 0 }};
+
+        for (int n = axis, r = firstRun; n >= 0; --n)
+        {
+            index[n] = r % count[n];
+            r /= count[n];
+        }
+
+        for (int r = firstRun; r < lastRun; ++r)
+        {
+            int offset = baseOffset;
+
+            for (int n = 0; n <= axis; ++n)
+            {
+                offset += index[n] * R.stride[n] * S[n];
+            }
+
+            double* a = array + offset;
+            double* b = buffer + std::size_t (r) * run;
+
+            if (toBuffer)
+            {
+                std::memcpy (b, a, run * sizeof (double));
+            }
+            else
+            {
+                std::memcpy (a, b, run * sizeof (double));
+            }
+
+            for (int n = axis; n >= 0; --n)
+            {
+                if (++index[n] < count[n]) break;
+                index[n] = 0;
+            }
+        }
+    };
+
+    // Spawning threads costs tens of microseconds, so thin regions are
+    // always copied on the calling thread.
+    const int minimumElementsPerThread = 1 << 16;
+    numThreads = std::max (1, std::min (numThreads, numRuns));
+    numThreads = std::min (numThreads, 1 + R.size() / minimumElementsPerThread);
+
+    if (numThreads == 1)
+    {
+        copyRuns (0, numRuns);
+        return;
+    }
+
+    auto threads = std::vector<std::thread>();
+
+    for (int t = 1; t < numThreads; ++t)
+    {
+        threads.emplace_back (copyRuns, t * numRuns / numThreads, (t + 1) * numRuns / numThreads);
+    }
+    copyRuns (0, numRuns / numThreads);
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
 Array Array::map (std::function<double (double)> function) const
 {
     auto A = *this;
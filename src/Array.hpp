@@ -5,6 +5,8 @@
 #include <array>
 #include <vector>
 #include <functional>
+#include <ostream>
+#include <string>
 
 
 
@@ -46,6 +48,15 @@ namespace Cow
         */
         HeapAllocation (std::string content);
 
+        /**
+        Take ownership of a block of memory that was not obtained from
+        malloc, such as an MPI shared memory window. The given function is
+        called to release it, instead of free. Copies of this block are
+        ordinary heap allocations, but copy-assigning to it keeps the block,
+        so the other block must have the same size.
+        */
+        HeapAllocation (void* memory, std::size_t numberOfBytes, std::function<void (void*)> deallocate);
+
         /**
         Construct this memory block from a deep copy of another one.
         */
@@ -57,7 +68,9 @@ namespace Cow
         HeapAllocation (HeapAllocation&& other);
 
         /**
-        Assign this block the contents of another (deep copy).
+        Assign this block the contents of another (deep copy). If this block
+        has a custom deallocator, it is kept, and a block of a different size
+        raises std::logic_error.
         */
         HeapAllocation& operator= (const HeapAllocation& other);
 
@@ -112,8 +125,10 @@ namespace Cow
         }
 
     private:
+        void release();
         void* allocation;
         std::size_t numberOfBytes;
+        std::function<void (void*)> deallocate;
     };
 
 
@@ -375,6 +390,13 @@ namespace Cow
         Array (int n1, int n2, int n3, int n4);
         Array (int n1, int n2, int n3, int n4, int n5);
 
+        /**
+        Return an array of the given shape whose memory is not initialized,
+        for use when every element is about to be overwritten, for example
+        by a read from a file.
+        */
+        static Array uninitialized (Shape shape);
+
         /**
         Copy constructor.
         */
@@ -464,6 +486,21 @@ namespace Cow
         */
         void copyFrom (const Array& A, Region targetRegion, Region sourceRegion=Region());
 
+        /**
+        Copy the given relative or absolute region of this array into a
+        contiguous buffer, in C order. The buffer must have room for
+        R.size() doubles. Contiguous runs of memory are moved with memcpy,
+        and if numThreads > 1 then large regions are split among that many
+        threads.
+        */
+        void packRegion (Region R, double* buffer, int numThreads=1) const;
+
+        /**
+        The inverse of packRegion: copy a contiguous buffer, in C order, into
+        the given region of this array.
+        */
+        void unpackRegion (Region R, const double* buffer, int numThreads=1);
+
         /**
         Change the Array's shape, without modifying its data layout. The new
         size must equal the old size.
@@ -644,6 +681,8 @@ namespace Cow
     private:
         /** @internal */
         static void copyRegion (Array& dst, const Array& src, Region source, Region target);
+        /** @internal */
+        static void copyRegionBuffer (double* array, Shape extent, Shape S, Region R, double* buffer, bool toBuffer, int numThreads);
         int n1, n2, n3, n4, n5;
         Shape S;
         HeapAllocation memory;
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "AsyncWriter.hpp"
+#include "HDF5.hpp"
+
+using namespace Cow;
+
+
+
+
+/**
+The largest number of idle staging buffers kept for reuse.
+*/
+static const std::size_t maxPoolSize = 64;
+
+
+
+
+// ============================================================================
+template <class T> bool AsyncWriter::Queue<T>::push (T& item)
+{
+    auto t = tail.load (std::memory_order_relaxed);
+    auto next = (t + 1) % items.size();
+
+    if (next == head.load (std::memory_order_acquire))
+    {
+        return false;
+    }
+    items[t] = std::move (item);
+    tail.store (next, std::memory_order_release);
+    return true;
+}
+
+template <class T> bool AsyncWriter::Queue<T>::pop (T& item)
+{
+    auto h = head.load (std::memory_order_relaxed);
+
+    if (h == tail.load (std::memory_order_acquire))
+    {
+        return false;
+    }
+    item = std::move (items[h]);
+    head.store ((h + 1) % items.size(), std::memory_order_release);
+    return true;
+}
+
+template <class T> bool AsyncWriter::Queue<T>::empty() const
+{
+    return head.load (std::memory_order_acquire) == tail.load (std::memory_order_acquire);
+}
+
+
+
+
+// ============================================================================
+AsyncWriter::Snapshot::Snapshot (AsyncWriter& writer, std::string fileName) :
+writer (&writer),
+fileName (fileName)
+{
+
+}
+
+void AsyncWriter::Snapshot::add (std::string name, const Array& A)
+{
+    auto staging = writer->takeStagingBuffer (A.shape());
+    std::memcpy (staging.begin(), A.getAllocation().begin(), A.size() * sizeof (double));
+    arrays.emplace_back (name, std::move (staging));
+}
+
+
+
+
+// ============================================================================
+AsyncWriter::AsyncWriter (int maxPending) :
+maxPending (std::max (maxPending, 1)),
+submitted (std::max (maxPending, 1)),
+recycled (maxPoolSize),
+numPending (0),
+running (true),
+failed (false)
+{
+    thread = std::thread (&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    waitUntil ([this] { return numPending.load() == 0; });
+    running = false;
+    notifyChanged();
+    thread.join();
+}
+
+AsyncWriter::Snapshot AsyncWriter::beginSnapshot (std::string fileName)
+{
+    return Snapshot (*this, fileName);
+}
+
+void AsyncWriter::submit (Snapshot snapshot)
+{
+    rethrowIfFailed();
+    waitUntil ([this] { return numPending.load() < maxPending; });
+
+    // The count is raised before the push, so there are never more
+    // snapshots in the queue than it has room for.
+    auto item = std::unique_ptr<Snapshot> (new Snapshot (std::move (snapshot)));
+    ++numPending;
+
+    if (! submitted.push (item))
+    {
+        --numPending;
+        throw std::logic_error ("AsyncWriter queue is full with fewer than maxPending snapshots pending");
+    }
+    notifyChanged();
+}
+
+void AsyncWriter::flush()
+{
+    waitUntil ([this] { return numPending.load() == 0; });
+    rethrowIfFailed();
+}
+
+int AsyncWriter::getNumPending() const
+{
+    return numPending.load();
+}
+
+void AsyncWriter::run()
+{
+    while (true)
+    {
+        auto snapshot = std::unique_ptr<Snapshot>();
+        waitUntil ([this] { return ! submitted.empty() || ! running.load(); });
+
+        if (! submitted.pop (snapshot))
+        {
+            return;
+        }
+
+        try
+        {
+            auto file = H5::File (snapshot->fileName, "w");
+
+            for (const auto& entry : snapshot->arrays)
+            {
+                file.writeArray (entry.first, entry.second);
+            }
+        }
+        catch (...)
+        {
+            if (! failed.load())
+            {
+                failure = std::current_exception();
+                failed = true;
+            }
+        }
+
+        // Buffers that do not fit in the queue are simply released.
+        for (auto& entry : snapshot->arrays)
+        {
+            recycled.push (entry.second);
+        }
+        --numPending;
+        notifyChanged();
+    }
+}
+
+void AsyncWriter::waitUntil (std::function<bool()> condition)
+{
+    std::unique_lock<std::mutex> lock (mutex);
+    changed.wait (lock, condition);
+}
+
+void AsyncWriter::notifyChanged()
+{
+    // The state was changed without the lock. Taking it, however briefly,
+    // means that a waiting thread is either still before its check of the
+    // state, and will see the change, or already asleep, and will be woken.
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+    }
+    changed.notify_all();
+}
+
+void AsyncWriter::rethrowIfFailed()
+{
+    if (failed.load())
+    {
+        auto error = failure;
+        failure = nullptr;
+        failed = false;
+        std::rethrow_exception (error);
+    }
+}
+
+Array AsyncWriter::takeStagingBuffer (Shape shape)
+{
+    auto buffer = Array();
+
+    while (recycled.pop (buffer))
+    {
+        stagingBuffers.push_back (std::move (buffer));
+    }
+
+    // Keep the pool bounded if the shapes being written change over time.
+    while (stagingBuffers.size() > maxPoolSize)
+    {
+        stagingBuffers.erase (stagingBuffers.begin());
+    }
+
+    for (auto it = stagingBuffers.begin(); it != stagingBuffers.end(); ++it)
+    {
+        if (it->shape() == shape)
+        {
+            buffer = std::move (*it);
+            stagingBuffers.erase (it);
+            return buffer;
+        }
+    }
+    return Array (shape);
+}
@@ -0,0 +1,147 @@
+#ifndef AsyncWriter_hpp
+#define AsyncWriter_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Array.hpp"
+
+
+
+
+namespace Cow
+{
+    class AsyncWriter;
+
+
+    /**
+    A pipeline that writes snapshots of arrays to HDF5 files on a background
+    thread, so that the simulation may go on computing while they are
+    written:
+
+        AsyncWriter writer (2);
+        auto snapshot = writer.beginSnapshot ("chkpt.0001.h5");
+        snapshot.add ("density", density);
+        snapshot.add ("pressure", pressure);
+        writer.submit (std::move (snapshot));
+
+    Arrays are copied into staging buffers when they are added, so they may
+    be modified as soon as add returns. Staging buffers are recycled once
+    their snapshot has been written, so that a steady cadence of snapshots
+    of the same shapes does not allocate. Snapshots are handed to the I/O
+    thread, and buffers handed back, through single-producer single-consumer
+    queues that take no locks. A mutex and condition variable are used only
+    to put the threads to sleep while they wait for each other.
+
+    At most maxPending snapshots may be waiting or being written; submit
+    blocks until one completes when there are more, so that output cannot
+    fall arbitrarily far behind and exhaust memory. Only one thread may call
+    the methods of a writer.
+
+    Unless the HDF5 library is built to be thread-safe, no other HDF5 calls
+    may be made while snapshots are pending; call flush before making them.
+    An exception thrown while writing is rethrown by the next call to submit
+    or flush.
+    */
+    class AsyncWriter
+    {
+    public:
+        /**
+        A set of named arrays to be written to one file.
+        */
+        class Snapshot
+        {
+        public:
+            /**
+            Copy A into a staging buffer, to be written as a data set with
+            the given name.
+            */
+            void add (std::string name, const Array& A);
+
+        private:
+            friend class AsyncWriter;
+            Snapshot (AsyncWriter& writer, std::string fileName);
+            AsyncWriter* writer;
+            std::string fileName;
+            std::vector<std::pair<std::string, Array>> arrays;
+        };
+
+        /**
+        Create a writer allowing at most the given number of pending
+        snapshots, and start its I/O thread.
+        */
+        AsyncWriter (int maxPending=2);
+
+        /**
+        Write all pending snapshots, and stop the I/O thread.
+        */
+        ~AsyncWriter();
+
+        /**
+        Begin a snapshot to be written to the given file, which is created
+        or truncated when the snapshot is written.
+        */
+        Snapshot beginSnapshot (std::string fileName);
+
+        /**
+        Queue a snapshot to be written, blocking while maxPending snapshots
+        are already pending.
+        */
+        void submit (Snapshot snapshot);
+
+        /**
+        Block until all submitted snapshots have been written.
+        */
+        void flush();
+
+        /**
+        Return the number of snapshots submitted and not yet written.
+        */
+        int getNumPending() const;
+
+    private:
+        /**
+        A bounded queue for one producer thread and one consumer thread. Each
+        index is written by only one of them.
+        */
+        template <class T> class Queue
+        {
+        public:
+            Queue (int capacity) : items (capacity + 1), head (0), tail (0) {}
+            bool push (T& item);
+            bool pop (T& item);
+            bool empty() const;
+        private:
+            std::vector<T> items;
+            std::atomic<std::size_t> head;
+            std::atomic<std::size_t> tail;
+        };
+
+        void run();
+        void waitUntil (std::function<bool()> condition);
+        void notifyChanged();
+        void rethrowIfFailed();
+        Array takeStagingBuffer (Shape shape);
+
+        const int maxPending;
+        Queue<std::unique_ptr<Snapshot>> submitted;
+        Queue<Array> recycled;
+        std::vector<Array> stagingBuffers;
+        std::atomic<int> numPending;
+        std::atomic<bool> running;
+        std::atomic<bool> failed;
+        std::exception_ptr failure;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::thread thread;
+    };
+}
+
+#endif
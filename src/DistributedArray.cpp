@@ -0,0 +1,560 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "DistributedArray.hpp"
+
+using namespace Cow;
+
+
+
+
+/**
+Set C to the intersection of the absolute, unit stride regions A and B, and
+return false if the intersection is empty. An empty intersection cannot be
+represented as a region, since a zero upper bound means "to the end".
+*/
+static bool intersect (const Region& A, const Region& B, Region& C)
+{
+    for (int n = 0; n < 5; ++n)
+    {
+        C.lower[n] = std::max (A.lower[n], B.lower[n]);
+        C.upper[n] = std::min (A.upper[n], B.upper[n]);
+        C.stride[n] = 1;
+
+        if (C.lower[n] >= C.upper[n]) return false;
+    }
+    return true;
+}
+
+
+
+
+// ============================================================================
+DistributedArray::DistributedArray() : numGhostCells (0)
+{
+
+}
+
+DistributedArray::DistributedArray (MpiCartComm communicator, Shape globalShape, int numGhostCells) :
+DistributedArray (communicator, globalShape, uniformBounds (communicator, globalShape), numGhostCells)
+{
+
+}
+
+DistributedArray::DistributedArray (MpiCartComm communicator, Shape globalShape,
+    std::vector<std::vector<int>> blockBounds, int numGhostCells) :
+communicator (communicator),
+globalShape (globalShape),
+numGhostCells (numGhostCells),
+blockBounds (blockBounds)
+{
+    auto dims = communicator.getDimensions();
+    auto localShape = globalShape;
+
+    if (blockBounds.size() != dims.size())
+    {
+        throw std::logic_error ("there must be block bounds for each axis of the communicator");
+    }
+
+    for (unsigned int axis = 0; axis < dims.size(); ++axis)
+    {
+        const auto& bounds = blockBounds[axis];
+
+        if (int (bounds.size()) != dims[axis] + 1
+            || bounds.front() != 0
+            || bounds.back() != globalShape[axis]
+            || ! std::is_sorted (bounds.begin(), bounds.end()))
+        {
+            throw std::logic_error ("block bounds must increase from 0 to the global size of the axis");
+        }
+    }
+
+    auto globalRegion = getGlobalRegion();
+
+    for (unsigned int axis = 0; axis < dims.size(); ++axis)
+    {
+        localShape[axis] = globalRegion.upper[axis] - globalRegion.lower[axis] + 2 * numGhostCells;
+
+        if (numGhostCells > 0 && localShape[axis] < 3 * numGhostCells)
+        {
+            throw std::logic_error ("DistributedArray blocks must be at least as wide as the ghost layer");
+        }
+    }
+    local = communicator.allocateForExchange (localShape);
+
+    if (numGhostCells > 0)
+    {
+        const int g = numGhostCells;
+
+        for (unsigned int axis = 0; axis < dims.size(); ++axis)
+        {
+            auto whole = Region::whole (localShape);
+            exchangePlans.push_back ({int (axis), 'R',
+                whole.withRange (axis, localShape[axis] - 2 * g, localShape[axis] - g),
+                whole.withRange (axis, 0, g)});
+            exchangePlans.push_back ({int (axis), 'L',
+                whole.withRange (axis, g, 2 * g),
+                whole.withRange (axis, localShape[axis] - g, localShape[axis])});
+        }
+    }
+}
+
+Region DistributedArray::getGlobalRegion (int processRank) const
+{
+    auto coords = communicator.getCoordinates (processRank);
+    auto R = Region::whole (globalShape);
+
+    for (unsigned int axis = 0; axis < blockBounds.size(); ++axis)
+    {
+        R.lower[axis] = blockBounds[axis][coords[axis]];
+        R.upper[axis] = blockBounds[axis][coords[axis] + 1];
+    }
+    return R;
+}
+
+Region DistributedArray::getInterior() const
+{
+    auto R = Region::whole (local.shape());
+
+    for (unsigned int axis = 0; axis < blockBounds.size(); ++axis)
+    {
+        R.lower[axis] += numGhostCells;
+        R.upper[axis] -= numGhostCells;
+    }
+    return R;
+}
+
+void DistributedArray::exchangeGhosts()
+{
+    // Copies of a distributed array hold their data in ordinary memory, so
+    // it is moved into a window the first time the exchange mode needs one.
+    if (! exchangePlans.empty() && ! communicator.canExchange (local))
+    {
+        auto exposed = communicator.allocateForExchange (local.shape());
+        exposed = local;
+        local = std::move (exposed);
+    }
+
+    for (const auto& plan : exchangePlans)
+    {
+        communicator.shiftExchange (local, plan.axis, plan.sendDirection, plan.send, plan.recv);
+    }
+}
+
+long DistributedArray::getInterNodeHaloVolume() const
+{
+    long volume = 0;
+
+    for (const auto& plan : exchangePlans)
+    {
+        int sourceRank = communicator.shift (plan.axis, plan.sendDirection == 'R' ? -1 : +1);
+
+        if (! communicator.isOnSameNode (sourceRank))
+        {
+            volume += plan.recv.size();
+        }
+    }
+    return communicator.sum (volume);
+}
+
+Array DistributedArray::read (Region globalRegion) const
+{
+    globalRegion.ensureAbsolute (globalShape);
+
+    if (globalRegion.stride != Index {{ 1, 1, 1, 1, 1 }})
+    {
+        throw std::logic_error ("DistributedArray regions must have unit stride");
+    }
+
+    // Each element of the region is owned by exactly one process, and the
+    // others contribute zero to it, so the sum is exact.
+
+    auto result = Array (globalRegion.shape());
+    auto owned = Region();
+
+    if (intersect (globalRegion, getGlobalRegion(), owned))
+    {
+        auto target = owned;
+
+        for (int n = 0; n < 5; ++n)
+        {
+            target.lower[n] -= globalRegion.lower[n];
+            target.upper[n] -= globalRegion.lower[n];
+        }
+        result.copyFrom (local, target, getLocalRegion (owned));
+    }
+    communicator.allreduce (result, MpiCommunicator::Reduction::sum);
+    return result;
+}
+
+void DistributedArray::write (Region globalRegion, const Array& values)
+{
+    globalRegion.ensureAbsolute (globalShape);
+
+    if (globalRegion.stride != Index {{ 1, 1, 1, 1, 1 }})
+    {
+        throw std::logic_error ("DistributedArray regions must have unit stride");
+    }
+    if (globalRegion.shape() != values.shape())
+    {
+        throw std::logic_error ("values must have the same shape as the region");
+    }
+
+    auto owned = Region();
+
+    if (intersect (globalRegion, getGlobalRegion(), owned))
+    {
+        auto source = owned;
+
+        for (int n = 0; n < 5; ++n)
+        {
+            source.lower[n] -= globalRegion.lower[n];
+            source.upper[n] -= globalRegion.lower[n];
+        }
+        local.copyFrom (values, getLocalRegion (owned), source);
+    }
+}
+
+double DistributedArray::minimum() const
+{
+    double x = std::numeric_limits<double>::infinity();
+    forEachInterior ([&] (double y) { x = std::min (x, y); });
+    return communicator.minimum (x);
+}
+
+double DistributedArray::maximum() const
+{
+    double x = -std::numeric_limits<double>::infinity();
+    forEachInterior ([&] (double y) { x = std::max (x, y); });
+    return communicator.maximum (x);
+}
+
+double DistributedArray::sum() const
+{
+    double x = 0.0;
+    forEachInterior ([&] (double y) { x += y; });
+    return communicator.sum (std::vector<double> (1, x))[0];
+}
+
+DistributedArray DistributedArray::redistribute (MpiCartComm newCommunicator, int newNumGhostCells) const
+{
+    if (newNumGhostCells == -1)
+    {
+        newNumGhostCells = numGhostCells;
+    }
+    auto target = DistributedArray (newCommunicator, globalShape, newNumGhostCells);
+    planRedistribution (target).execute (local, target.local);
+    target.exchangeGhosts();
+    return target;
+}
+
+MpiRedistributionPlan DistributedArray::planRedistribution (const DistributedArray& target,
+    MpiRedistributionPlan::Method method, int numChunks) const
+{
+    const auto& targetCommunicator = target.communicator;
+    auto newRanks = communicator.translateRanks (targetCommunicator);
+
+    if (std::count (newRanks.begin(), newRanks.end(), -1) > 0 || targetCommunicator.size() != communicator.size())
+    {
+        throw std::logic_error ("the new communicator must contain the same processes");
+    }
+    if (target.globalShape != globalShape)
+    {
+        throw std::logic_error ("the target must have the same global shape");
+    }
+
+    auto sendRegions = std::vector<Region> (communicator.size(), Region::empty());
+    auto recvRegions = std::vector<Region> (communicator.size(), Region::empty());
+    auto sourceRegion = getGlobalRegion();
+    auto targetRegion = target.getGlobalRegion();
+
+    for (int rank : getOverlappingRanks (targetRegion))
+    {
+        auto overlap = Region();
+
+        if (intersect (targetRegion, getGlobalRegion (rank), overlap))
+        {
+            recvRegions[rank] = target.getLocalRegion (overlap);
+        }
+    }
+
+    for (int rank = 0; rank < communicator.size(); ++rank)
+    {
+        auto overlap = Region();
+
+        if (intersect (sourceRegion, target.getGlobalRegion (newRanks[rank]), overlap))
+        {
+            sendRegions[rank] = getLocalRegion (overlap);
+        }
+    }
+
+    return MpiRedistributionPlan (communicator,
+        local.shape(), sendRegions,
+        target.local.shape(), recvRegions,
+        method, numChunks);
+}
+
+std::vector<std::vector<int>> DistributedArray::balancedBounds (const DistributedArray& weights) const
+{
+    auto projectedCost = std::vector<Array>();
+    auto weightsRegion = weights.getGlobalRegion();
+    auto interior = weights.getInterior();
+    auto& W = const_cast<Array&> (weights.local);
+
+    for (unsigned int axis = 0; axis < blockBounds.size(); ++axis)
+    {
+        if (weights.globalShape[axis] != globalShape[axis])
+        {
+            throw std::logic_error ("weights must have the same global shape on the distributed axes");
+        }
+        projectedCost.push_back (Array (globalShape[axis]));
+    }
+
+    for (auto it = W[interior].begin(); it != W[interior].end(); ++it)
+    {
+        auto index = it.relativeIndex();
+
+        for (unsigned int axis = 0; axis < blockBounds.size(); ++axis)
+        {
+            projectedCost[axis][weightsRegion.lower[axis] + index[axis]] += *it;
+        }
+    }
+    return balancedBounds (projectedCost);
+}
+
+std::vector<std::vector<int>> DistributedArray::balancedBounds (double localCost) const
+{
+    auto projectedCost = std::vector<Array>();
+    auto blockRegion = getGlobalRegion();
+
+    for (unsigned int axis = 0; axis < blockBounds.size(); ++axis)
+    {
+        auto range = blockRegion.range (axis);
+        auto cost = Array (globalShape[axis]);
+
+        for (int i = range.lower; i < range.upper; ++i)
+        {
+            cost[i] = localCost / range.size();
+        }
+        projectedCost.push_back (cost);
+    }
+    return balancedBounds (projectedCost);
+}
+
+void DistributedArray::rebalance (std::vector<std::vector<int>> newBounds)
+{
+    auto target = DistributedArray (communicator, globalShape, newBounds, numGhostCells);
+    migrateTo (target);
+    *this = std::move (target);
+}
+
+std::vector<std::vector<int>> DistributedArray::uniformBounds (const MpiCartComm& communicator, Shape globalShape)
+{
+    auto dims = communicator.getDimensions();
+    auto bounds = std::vector<std::vector<int>> (dims.size());
+
+    for (unsigned int axis = 0; axis < dims.size(); ++axis)
+    {
+        for (int c = 0; c <= dims[axis]; ++c)
+        {
+            bounds[axis].push_back (globalShape[axis] * c / dims[axis]);
+        }
+    }
+    return bounds;
+}
+
+std::vector<int> DistributedArray::partition (const std::vector<double>& cost, int numBlocks, int minimumWidth)
+{
+    const int N = cost.size();
+
+    if (numBlocks * minimumWidth > N)
+    {
+        throw std::logic_error ("cannot cut an axis of " + std::to_string (N) + " cells into "
+            + std::to_string (numBlocks) + " blocks at least " + std::to_string (minimumWidth) + " wide");
+    }
+    auto cumulative = std::vector<double> (N + 1, 0.0);
+    auto bounds = std::vector<int> (numBlocks + 1);
+
+    for (int i = 0; i < N; ++i)
+    {
+        cumulative[i + 1] = cumulative[i] + cost[i];
+    }
+
+    for (int c = 0; c <= numBlocks; ++c)
+    {
+        if (cumulative[N] <= 0.0)
+        {
+            bounds[c] = N * c / numBlocks;
+            continue;
+        }
+
+        // Place the bound at whichever cell edge has cumulative cost closest
+        // to the ideal share.
+        const double ideal = cumulative[N] * c / numBlocks;
+        int b = std::lower_bound (cumulative.begin(), cumulative.end(), ideal) - cumulative.begin();
+
+        if (b > 0 && ideal - cumulative[b - 1] < cumulative[b] - ideal)
+        {
+            --b;
+        }
+        bounds[c] = b;
+    }
+
+    // Enforce the minimum width, first from the left and then from the
+    // right, so that the end points stay at 0 and N.
+
+    bounds[0] = 0;
+    bounds[numBlocks] = N;
+
+    for (int c = 1; c < numBlocks; ++c)
+    {
+        bounds[c] = std::max (bounds[c], bounds[c - 1] + minimumWidth);
+    }
+    for (int c = numBlocks - 1; c > 0; --c)
+    {
+        bounds[c] = std::min (bounds[c], bounds[c + 1] - minimumWidth);
+    }
+    return bounds;
+}
+
+std::vector<std::vector<int>> DistributedArray::balancedBounds (const std::vector<Array>& projectedCost) const
+{
+    // Reduce the projections for all axes in a single collective.
+
+    int totalLength = 0;
+
+    for (const auto& cost : projectedCost)
+    {
+        totalLength += cost.size();
+    }
+
+    auto packed = Array (totalLength);
+    int offset = 0;
+
+    for (const auto& cost : projectedCost)
+    {
+        for (int n = 0; n < cost.size(); ++n)
+        {
+            packed[offset + n] = cost[n];
+        }
+        offset += cost.size();
+    }
+    communicator.allreduce (packed, MpiCommunicator::Reduction::sum);
+
+    auto dims = communicator.getDimensions();
+    auto bounds = std::vector<std::vector<int>>();
+    offset = 0;
+
+    for (unsigned int axis = 0; axis < dims.size(); ++axis)
+    {
+        auto cost = std::vector<double> (&packed[offset], &packed[offset] + globalShape[axis]);
+        bounds.push_back (partition (cost, dims[axis], std::max (1, numGhostCells)));
+        offset += globalShape[axis];
+    }
+    return bounds;
+}
+
+std::vector<int> DistributedArray::getOverlappingRanks (Region globalRegion) const
+{
+    // The blocks overlapping the region along each axis form a contiguous
+    // range of coordinates, so the overlapping ranks are found without
+    // visiting every process.
+
+    auto first = std::vector<int>();
+    auto last = std::vector<int>();
+    auto ranks = std::vector<int>();
+
+    for (const auto& bounds : blockBounds)
+    {
+        int axis = first.size();
+        int lower = globalRegion.lower[axis];
+        int upper = globalRegion.upper[axis];
+        first.push_back (std::upper_bound (bounds.begin(), bounds.end(), lower) - bounds.begin() - 1);
+        last.push_back (std::lower_bound (bounds.begin(), bounds.end(), upper) - bounds.begin() - 1);
+    }
+
+    auto coords = first;
+
+    while (true)
+    {
+        ranks.push_back (communicator.getCartRank (coords));
+
+        int axis = coords.size() - 1;
+
+        while (axis >= 0 && ++coords[axis] > last[axis])
+        {
+            coords[axis] = first[axis];
+            --axis;
+        }
+        if (axis < 0) break;
+    }
+    return ranks;
+}
+
+void DistributedArray::migrateTo (DistributedArray& target) const
+{
+    const auto& targetCommunicator = target.communicator;
+    auto newRanks = communicator.translateRanks (targetCommunicator);
+    auto oldRanks = targetCommunicator.translateRanks (communicator);
+
+    if (std::count (newRanks.begin(), newRanks.end(), -1) > 0 || targetCommunicator.size() != communicator.size())
+    {
+        throw std::logic_error ("the new communicator must contain the same processes");
+    }
+
+    // Messages are exchanged over the old communicator. Each process sends
+    // the part of its old block lying in each new block, and receives the
+    // part of its new block lying in each old block.
+
+    auto requests = std::vector<MpiRequest>();
+    auto sourceRegion = getGlobalRegion();
+    auto targetRegion = target.getGlobalRegion();
+
+    for (int rank : getOverlappingRanks (targetRegion))
+    {
+        auto overlap = Region();
+
+        if (intersect (targetRegion, getGlobalRegion (rank), overlap))
+        {
+            requests.push_back (communicator.request (target.local, target.getLocalRegion (overlap), rank));
+        }
+    }
+
+    for (int newRank : target.getOverlappingRanks (sourceRegion))
+    {
+        auto overlap = Region();
+
+        if (intersect (sourceRegion, target.getGlobalRegion (newRank), overlap))
+        {
+            requests.push_back (communicator.post (local, getLocalRegion (overlap), oldRanks[newRank]));
+        }
+    }
+
+    for (auto& request : requests)
+    {
+        request.wait();
+    }
+    target.exchangeGhosts();
+}
+
+Region DistributedArray::getLocalRegion (Region globalRegion) const
+{
+    auto blockRegion = getGlobalRegion();
+
+    for (unsigned int axis = 0; axis < blockBounds.size(); ++axis)
+    {
+        globalRegion.lower[axis] += numGhostCells - blockRegion.lower[axis];
+        globalRegion.upper[axis] += numGhostCells - blockRegion.lower[axis];
+    }
+    return globalRegion;
+}
+
+void DistributedArray::forEachInterior (std::function<void (double)> callback) const
+{
+    // Array::Reference does not have a const version, but the values are
+    // only read here.
+    for (auto& x : const_cast<Array&> (local)[getInterior()])
+    {
+        callback (x);
+    }
+}
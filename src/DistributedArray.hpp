@@ -0,0 +1,232 @@
+#ifndef DistributedArray_hpp
+#define DistributedArray_hpp
+
+#include <vector>
+#include "Array.hpp"
+#include "MPI.hpp"
+
+
+
+
+namespace Cow
+{
+    class DistributedArray;
+
+
+    /**
+    An array whose global extent is decomposed into blocks over the
+    processes of a cartesian communicator. Axis n of the global array, for n
+    less than the communicator's number of dimensions, is split across the
+    processes along axis n of the topology. Remaining axes (e.g. field
+    components on axis 3) are not distributed.
+
+    Each process owns a local Array holding its block, padded by a layer of
+    ghost cells on each distributed axis. Regions passed to the methods of
+    this class are in global index space unless stated otherwise. The send
+    and receive regions used to fill the ghost cells are computed once, on
+    construction.
+
+    The decomposition is rectilinear: on each distributed axis there is a
+    list of block bounds, [0, b1, b2, ..., N], with one interval for each
+    process along that axis of the topology. The intervals need not have
+    equal size, which allows the load to be balanced when the cost per cell
+    is not uniform (see balancedBounds and rebalance).
+    */
+    class DistributedArray
+    {
+    public:
+        /**
+        Default constructor, creates an unusable distributed array.
+        */
+        DistributedArray();
+
+        /**
+        Create a zero-initialized distributed array of the given global shape
+        over the processes of the given communicator. The global extent on
+        each distributed axis is split into blocks whose sizes differ by at
+        most one.
+        */
+        DistributedArray (MpiCartComm communicator, Shape globalShape, int numGhostCells=0);
+
+        /**
+        Create a zero-initialized distributed array with the given block
+        bounds. There must be one list of bounds for each axis of the
+        communicator, having one more entry than the number of processes on
+        that axis, starting at 0 and ending at the global size of the axis.
+        */
+        DistributedArray (MpiCartComm communicator, Shape globalShape,
+            std::vector<std::vector<int>> blockBounds, int numGhostCells=0);
+
+        /**
+        Return the communicator over which this array is distributed.
+        */
+        const MpiCartComm& getCommunicator() const { return communicator; }
+
+        /**
+        Return the shape of the global array.
+        */
+        Shape getGlobalShape() const { return globalShape; }
+
+        /**
+        Return the width of the ghost cell layer.
+        */
+        int getNumGhostCells() const { return numGhostCells; }
+
+        /**
+        Return the block bounds on each distributed axis.
+        */
+        const std::vector<std::vector<int>>& getBlockBounds() const { return blockBounds; }
+
+        /**
+        Return the absolute global region owned by the given process, or by
+        this process if processRank is -1. Ghost cells are not included.
+        */
+        Region getGlobalRegion (int processRank=-1) const;
+
+        /**
+        Return the absolute region of the local array which excludes the
+        ghost cells.
+        */
+        Region getInterior() const;
+
+        /**
+        Return the local array, including ghost cells.
+        */
+        Array& getLocalArray() { return local; }
+
+        /**
+        Return the local array, including ghost cells.
+        */
+        const Array& getLocalArray() const { return local; }
+
+        /**
+        Fill the ghost cells with data from neighboring processes, one axis at
+        a time so that edge and corner ghost cells are filled too. The
+        topology is periodic, so the outer ghost cells of the global array
+        wrap around. If the communicator's exchange mode needs a window
+        (see MpiCartComm::allocateForExchange), the local array is kept in
+        one, so that neighbors load or put ghost data directly. This is a
+        collective operation.
+        */
+        void exchangeGhosts();
+
+        /**
+        Return the number of ghost cells, summed over all processes, which
+        exchangeGhosts receives from processes on other nodes. Comparing it
+        with the total number of ghost cells shows how well the topology's
+        rank placement keeps halo traffic on the nodes (see
+        MpiCommunicator::createCartesian). This is a collective operation.
+        */
+        long getInterNodeHaloVolume() const;
+
+        /**
+        Return the contents of the given global region, on every process.
+        The region may be relative or absolute, but must have unit strides.
+        This is a collective operation.
+        */
+        Array read (Region globalRegion) const;
+
+        /**
+        Write values into the given global region. Every process passes the
+        same values, and updates the part of the region it owns. Ghost cells
+        are not updated; call exchangeGhosts afterwards if needed.
+        */
+        void write (Region globalRegion, const Array& values);
+
+        /**
+        Return the minimum of the global array. This is a collective
+        operation.
+        */
+        double minimum() const;
+
+        /**
+        Return the maximum of the global array. This is a collective
+        operation.
+        */
+        double maximum() const;
+
+        /**
+        Return the sum of the global array. This is a collective operation.
+        */
+        double sum() const;
+
+        /**
+        Return a copy of this array, distributed over a different cartesian
+        communicator containing the same processes. If numGhostCells is -1,
+        the new array has the same ghost width as this one. Ghost cells of the
+        new array are filled. This uses a single all-to-all exchange (see
+        planRedistribution), and is a collective operation over both
+        communicators.
+        */
+        DistributedArray redistribute (MpiCartComm newCommunicator, int numGhostCells=-1) const;
+
+        /**
+        Create a plan that moves the interior of this array into the
+        interior of the target, which covers the same global shape over a
+        different decomposition of the same processes. For example, the
+        target may be a pencil decomposition, created with
+        createCartesian (3, {true, true, false}), of a field held here in
+        blocks. The plan may be executed as many times as needed:
+
+            auto plan = blocks.planRedistribution (pencils);
+            plan.execute (blocks.getLocalArray(), pencils.getLocalArray());
+
+        This is a collective operation.
+        */
+        MpiRedistributionPlan planRedistribution (const DistributedArray& target,
+            MpiRedistributionPlan::Method method=MpiRedistributionPlan::Method::alltoallv,
+            int numChunks=4) const;
+
+        /**
+        Return block bounds for this array's communicator that balance the
+        total cost of each block, where the cost of each cell is given by
+        the interior values of the weights array (summed over any axes that
+        are not distributed). The weights may be distributed differently
+        than this array. On each axis, the cost is projected onto that axis
+        and cut into intervals of equal cost, and no block is made narrower
+        than the ghost layer. This is a collective operation.
+        */
+        std::vector<std::vector<int>> balancedBounds (const DistributedArray& weights) const;
+
+        /**
+        Return block bounds that balance a measured cost, such as the time
+        this process spent on its last step. The cost is assumed to be
+        spread uniformly over this process's block. This is a collective
+        operation.
+        */
+        std::vector<std::vector<int>> balancedBounds (double localCost) const;
+
+        /**
+        Move to the given block bounds, keeping the same communicator and
+        data. Each process exchanges only the slabs that cross between its
+        old and new block, which for small adjustments of the bounds are
+        only sent to neighbors. Ghost cells are filled afterwards. This is a
+        collective operation.
+        */
+        void rebalance (std::vector<std::vector<int>> newBounds);
+
+    private:
+        struct ExchangePlan
+        {
+            int axis;
+            char sendDirection;
+            Region send;
+            Region recv;
+        };
+        static std::vector<std::vector<int>> uniformBounds (const MpiCartComm& communicator, Shape globalShape);
+        static std::vector<int> partition (const std::vector<double>& cost, int numBlocks, int minimumWidth);
+        std::vector<std::vector<int>> balancedBounds (const std::vector<Array>& projectedCost) const;
+        std::vector<int> getOverlappingRanks (Region globalRegion) const;
+        void migrateTo (DistributedArray& target) const;
+        Region getLocalRegion (Region globalRegion) const;
+        void forEachInterior (std::function<void (double)> callback) const;
+        MpiCartComm communicator;
+        Shape globalShape;
+        int numGhostCells;
+        std::vector<std::vector<int>> blockBounds;
+        std::vector<ExchangePlan> exchangePlans;
+        Array local;
+    };
+}
+
+#endif
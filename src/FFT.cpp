@@ -0,0 +1,643 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include "FFT.hpp"
+
+using namespace Cow;
+using Complex = std::complex<double>;
+
+
+
+
+/**
+Complex multiplication written out by hand. The std::complex operator
+checks for infinities and NaN's, which stops loops from being vectorized.
+*/
+static inline Complex multiply (Complex a, Complex b)
+{
+    return Complex (
+        a.real() * b.real() - a.imag() * b.imag(),
+        a.real() * b.imag() + a.imag() * b.real());
+}
+
+static inline Complex timesMinusI (Complex z)
+{
+    return Complex (z.imag(), -z.real());
+}
+
+
+
+
+// ============================================================================
+// Stockham butterflies. Each stage reads p sub-sequences of length m from x,
+// each strided by s, and writes p * m outputs to y. The innermost loop over
+// q runs over contiguous memory, and covers both the batch and the
+// sub-sequences produced by earlier stages.
+// ============================================================================
+static void butterfly2 (const Complex* x, Complex* y, int m, int s, const Complex* w)
+{
+    for (int j = 0; j < m; ++j)
+    {
+        const Complex w1 = w[2 * j + 1];
+        const Complex* a0 = x + s * (j + 0 * m);
+        const Complex* a1 = x + s * (j + 1 * m);
+        Complex* b0 = y + s * (2 * j + 0);
+        Complex* b1 = y + s * (2 * j + 1);
+
+        for (int q = 0; q < s; ++q)
+        {
+            const Complex u = a0[q];
+            const Complex v = a1[q];
+            b0[q] = u + v;
+            b1[q] = multiply (u - v, w1);
+        }
+    }
+}
+
+static void butterfly3 (const Complex* x, Complex* y, int m, int s, const Complex* w)
+{
+    const double s3 = std::sqrt (3.0) / 2;
+
+    for (int j = 0; j < m; ++j)
+    {
+        const Complex w1 = w[3 * j + 1];
+        const Complex w2 = w[3 * j + 2];
+        const Complex* a0 = x + s * (j + 0 * m);
+        const Complex* a1 = x + s * (j + 1 * m);
+        const Complex* a2 = x + s * (j + 2 * m);
+        Complex* b0 = y + s * (3 * j + 0);
+        Complex* b1 = y + s * (3 * j + 1);
+        Complex* b2 = y + s * (3 * j + 2);
+
+        for (int q = 0; q < s; ++q)
+        {
+            const Complex t1 = a1[q] + a2[q];
+            const Complex t2 = a0[q] - 0.5 * t1;
+            const Complex t3 = timesMinusI (s3 * (a1[q] - a2[q]));
+            b0[q] = a0[q] + t1;
+            b1[q] = multiply (t2 + t3, w1);
+            b2[q] = multiply (t2 - t3, w2);
+        }
+    }
+}
+
+static void butterfly4 (const Complex* x, Complex* y, int m, int s, const Complex* w)
+{
+    for (int j = 0; j < m; ++j)
+    {
+        const Complex w1 = w[4 * j + 1];
+        const Complex w2 = w[4 * j + 2];
+        const Complex w3 = w[4 * j + 3];
+        const Complex* a0 = x + s * (j + 0 * m);
+        const Complex* a1 = x + s * (j + 1 * m);
+        const Complex* a2 = x + s * (j + 2 * m);
+        const Complex* a3 = x + s * (j + 3 * m);
+        Complex* b0 = y + s * (4 * j + 0);
+        Complex* b1 = y + s * (4 * j + 1);
+        Complex* b2 = y + s * (4 * j + 2);
+        Complex* b3 = y + s * (4 * j + 3);
+
+        for (int q = 0; q < s; ++q)
+        {
+            const Complex t0 = a0[q] + a2[q];
+            const Complex t1 = a0[q] - a2[q];
+            const Complex t2 = a1[q] + a3[q];
+            const Complex t3 = timesMinusI (a1[q] - a3[q]);
+            b0[q] = t0 + t2;
+            b1[q] = multiply (t1 + t3, w1);
+            b2[q] = multiply (t0 - t2, w2);
+            b3[q] = multiply (t1 - t3, w3);
+        }
+    }
+}
+
+static void butterfly5 (const Complex* x, Complex* y, int m, int s, const Complex* w)
+{
+    const double pi = 4 * std::atan (1.0);
+    const double c1 = std::cos (2 * pi / 5);
+    const double c2 = std::cos (4 * pi / 5);
+    const double s1 = std::sin (2 * pi / 5);
+    const double s2 = std::sin (4 * pi / 5);
+
+    for (int j = 0; j < m; ++j)
+    {
+        const Complex w1 = w[5 * j + 1];
+        const Complex w2 = w[5 * j + 2];
+        const Complex w3 = w[5 * j + 3];
+        const Complex w4 = w[5 * j + 4];
+        const Complex* a0 = x + s * (j + 0 * m);
+        const Complex* a1 = x + s * (j + 1 * m);
+        const Complex* a2 = x + s * (j + 2 * m);
+        const Complex* a3 = x + s * (j + 3 * m);
+        const Complex* a4 = x + s * (j + 4 * m);
+        Complex* b0 = y + s * (5 * j + 0);
+        Complex* b1 = y + s * (5 * j + 1);
+        Complex* b2 = y + s * (5 * j + 2);
+        Complex* b3 = y + s * (5 * j + 3);
+        Complex* b4 = y + s * (5 * j + 4);
+
+        for (int q = 0; q < s; ++q)
+        {
+            const Complex t1 = a1[q] + a4[q];
+            const Complex t2 = a2[q] + a3[q];
+            const Complex t3 = a1[q] - a4[q];
+            const Complex t4 = a2[q] - a3[q];
+            const Complex u1 = a0[q] + c1 * t1 + c2 * t2;
+            const Complex u2 = a0[q] + c2 * t1 + c1 * t2;
+            const Complex v1 = timesMinusI (s1 * t3 + s2 * t4);
+            const Complex v2 = timesMinusI (s2 * t3 - s1 * t4);
+            b0[q] = a0[q] + t1 + t2;
+            b1[q] = multiply (u1 + v1, w1);
+            b2[q] = multiply (u2 + v2, w2);
+            b3[q] = multiply (u2 - v2, w3);
+            b4[q] = multiply (u1 - v1, w4);
+        }
+    }
+}
+
+
+
+
+// ============================================================================
+FFT::FFT (int size) : n (size)
+{
+    if (! isSupportedSize (size))
+    {
+        throw std::runtime_error ("FFT size " + std::to_string (size) + " has prime factors other than 2, 3, and 5");
+    }
+
+    int remaining = size;
+
+    for (int p : {4, 2, 3, 5})
+    {
+        while (remaining % p == 0)
+        {
+            radices.push_back (p);
+            remaining /= p;
+        }
+    }
+
+    // Stage twiddle factors are w[j * p + t] = exp(-2 pi i j t / L), where
+    // L is the length of the sub-transforms at that stage, so j * t < L.
+
+    const double pi = 4 * std::atan (1.0);
+    int length = size;
+
+    for (int p : radices)
+    {
+        const int m = length / p;
+        auto w = std::vector<Complex> (m * p);
+
+        for (int j = 0; j < m; ++j)
+        {
+            for (int t = 0; t < p; ++t)
+            {
+                w[j * p + t] = std::polar (1.0, -2 * pi * j * t / length);
+            }
+        }
+        twiddles.push_back (w);
+        length = m;
+    }
+}
+
+bool FFT::isSupportedSize (int size)
+{
+    if (size < 1)
+    {
+        return false;
+    }
+    for (int p : {2, 3, 5})
+    {
+        while (size % p == 0)
+        {
+            size /= p;
+        }
+    }
+    return size == 1;
+}
+
+const FFT& FFT::plan (int size)
+{
+    static std::map<int, std::unique_ptr<FFT>> plans;
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock (mutex);
+
+    auto& entry = plans[size];
+
+    if (! entry)
+    {
+        entry.reset (new FFT (size));
+    }
+    return *entry;
+}
+
+void FFT::execute (Complex* data, int count, int sign) const
+{
+    auto work = std::vector<Complex> (std::size_t (n) * count);
+    execute (data, &work[0], count, sign);
+}
+
+void FFT::execute (Complex* data, Complex* work, int count, int sign) const
+{
+    const std::size_t total = std::size_t (n) * count;
+
+    // The inverse is computed as conj (forward (conj (x))).
+
+    if (sign == +1)
+    {
+        for (std::size_t i = 0; i < total; ++i) data[i] = std::conj (data[i]);
+    }
+
+    Complex* x = data;
+    Complex* y = work;
+    int s = count;
+    int length = n;
+
+    for (unsigned int stage = 0; stage < radices.size(); ++stage)
+    {
+        const int p = radices[stage];
+        const int m = length / p;
+        const Complex* w = &twiddles[stage][0];
+
+        switch (p)
+        {
+            case 2: butterfly2 (x, y, m, s, w); break;
+            case 3: butterfly3 (x, y, m, s, w); break;
+            case 4: butterfly4 (x, y, m, s, w); break;
+            case 5: butterfly5 (x, y, m, s, w); break;
+            default: assert (false);
+        }
+        std::swap (x, y);
+        s *= p;
+        length = m;
+    }
+
+    if (x != data)
+    {
+        std::copy (x, x + total, data);
+    }
+
+    if (sign == +1)
+    {
+        for (std::size_t i = 0; i < total; ++i) data[i] = std::conj (data[i]);
+    }
+}
+
+void FFT::forward (Array& A, int axis)
+{
+    transform (A, axis, -1);
+}
+
+void FFT::inverse (Array& A, int axis)
+{
+    transform (A, axis, +1);
+
+    const double scale = 1.0 / A.size (axis);
+
+    for (auto& x : A)
+    {
+        x *= scale;
+    }
+}
+
+void FFT::transform (Array& A, int axis, int sign)
+{
+    assert (0 <= axis && axis < 4);
+
+    if (A.size (4) != 2)
+    {
+        throw std::logic_error ("complex arrays must have size 2 on axis 4");
+    }
+    if (A.size() == 0)
+    {
+        return;
+    }
+
+    // Transforms along the given axis are batched over all the axes inside
+    // of it, which are contiguous in memory.
+
+    const int N = A.size (axis);
+    int outer = 1;
+    int inner = 1;
+
+    for (int n = 0; n < axis; ++n) outer *= A.size (n);
+    for (int n = axis + 1; n < 4; ++n) inner *= A.size (n);
+
+    const auto& fft = plan (N);
+    auto data = reinterpret_cast<Complex*> (A.begin());
+    auto work = std::vector<Complex> (std::size_t (N) * inner);
+
+    for (int o = 0; o < outer; ++o)
+    {
+        fft.execute (data + std::size_t (o) * N * inner, &work[0], inner, sign);
+    }
+}
+
+Array FFT::forwardReal (const Array& A, int axis)
+{
+    assert (0 <= axis && axis < 4);
+
+    if (A.size (4) != 1)
+    {
+        throw std::logic_error ("real arrays must have size 1 on axis 4");
+    }
+
+    const int N = A.size (axis);
+    const int h = N / 2;
+    auto shape = A.shape();
+    shape[axis] = h + 1;
+    shape[4] = 2;
+
+    if (N % 2 == 1 || A.size() == 0)
+    {
+        auto C = toComplex (A);
+        forward (C, axis);
+        return C.extract (Region (C.shape()).withRange (axis, 0, h + 1));
+    }
+
+    // Transform z[n] = x[2n] + i x[2n + 1], which has half the size, then
+    // separate the transforms of the even and odd samples, E and O, using
+    // the symmetry of transforms of real data, and combine them.
+
+    const double pi = 4 * std::atan (1.0);
+    int outer = 1;
+    int inner = 1;
+
+    for (int n = 0; n < axis; ++n) outer *= A.size (n);
+    for (int n = axis + 1; n < 4; ++n) inner *= A.size (n);
+
+    auto B = Array (shape);
+    const auto& fft = plan (h);
+    auto z = std::vector<Complex> (h * inner);
+    auto work = std::vector<Complex> (z.size());
+    auto X = reinterpret_cast<Complex*> (B.begin());
+    auto x = static_cast<const double*> (A.getAllocation().begin());
+
+    for (int o = 0; o < outer; ++o)
+    {
+        const double* xo = x + std::size_t (o) * N * inner;
+        Complex* Xo = X + std::size_t (o) * (h + 1) * inner;
+
+        for (int i = 0; i < h; ++i)
+        {
+            for (int b = 0; b < inner; ++b)
+            {
+                z[i * inner + b] = Complex (xo[(2 * i) * inner + b], xo[(2 * i + 1) * inner + b]);
+            }
+        }
+
+        fft.execute (&z[0], &work[0], inner, -1);
+
+        for (int k = 0; k <= h; ++k)
+        {
+            const Complex w = std::polar (1.0, -2 * pi * k / N);
+
+            for (int b = 0; b < inner; ++b)
+            {
+                const Complex Zk = z[(k % h) * inner + b];
+                const Complex Zc = std::conj (z[((h - k) % h) * inner + b]);
+                const Complex E = 0.5 * (Zk + Zc);
+                const Complex O = timesMinusI (0.5 * (Zk - Zc));
+                Xo[k * inner + b] = E + multiply (w, O);
+            }
+        }
+    }
+    return B;
+}
+
+Array FFT::inverseReal (const Array& B, int axis, int N)
+{
+    assert (0 <= axis && axis < 4);
+
+    if (B.size (4) != 2)
+    {
+        throw std::logic_error ("complex arrays must have size 2 on axis 4");
+    }
+    if (B.size (axis) != N / 2 + 1)
+    {
+        throw std::logic_error ("spectrum does not have N / 2 + 1 entries along the axis");
+    }
+
+    const int h = N / 2;
+    auto shape = B.shape();
+    shape[axis] = N;
+    shape[4] = 1;
+
+    int outer = 1;
+    int inner = 1;
+
+    for (int n = 0; n < axis; ++n) outer *= B.size (n);
+    for (int n = axis + 1; n < 4; ++n) inner *= B.size (n);
+
+    auto X = reinterpret_cast<const Complex*> (B.getAllocation().begin());
+
+    if (N % 2 == 1 || B.size() == 0)
+    {
+        // Rebuild the negative frequencies from the Hermitian symmetry.
+        auto C = Array (shape[0], shape[1], shape[2], shape[3], 2);
+        auto Y = reinterpret_cast<Complex*> (C.begin());
+
+        for (int o = 0; o < outer; ++o)
+        {
+            for (int k = 0; k < N; ++k)
+            {
+                for (int b = 0; b < inner; ++b)
+                {
+                    const auto source = X + std::size_t (o) * (h + 1) * inner;
+                    const auto value = k <= h ? source[k * inner + b] : std::conj (source[(N - k) * inner + b]);
+                    Y[(std::size_t (o) * N + k) * inner + b] = value;
+                }
+            }
+        }
+        inverse (C, axis);
+        return realPart (C);
+    }
+
+    const double pi = 4 * std::atan (1.0);
+    auto A = Array (shape);
+    const auto& fft = plan (h);
+    auto z = std::vector<Complex> (h * inner);
+    auto work = std::vector<Complex> (z.size());
+    auto x = A.begin();
+
+    for (int o = 0; o < outer; ++o)
+    {
+        const Complex* Xo = X + std::size_t (o) * (h + 1) * inner;
+        double* xo = x + std::size_t (o) * N * inner;
+
+        for (int k = 0; k < h; ++k)
+        {
+            const Complex w = std::polar (1.0, 2 * pi * k / N);
+
+            for (int b = 0; b < inner; ++b)
+            {
+                const Complex Xk = Xo[k * inner + b];
+                const Complex Xc = std::conj (Xo[(h - k) * inner + b]);
+                const Complex E = 0.5 * (Xk + Xc);
+                const Complex O = multiply (w, 0.5 * (Xk - Xc));
+                z[k * inner + b] = E + Complex (-O.imag(), O.real());
+            }
+        }
+
+        fft.execute (&z[0], &work[0], inner, +1);
+
+        for (int i = 0; i < h; ++i)
+        {
+            for (int b = 0; b < inner; ++b)
+            {
+                xo[(2 * i + 0) * inner + b] = z[i * inner + b].real() / h;
+                xo[(2 * i + 1) * inner + b] = z[i * inner + b].imag() / h;
+            }
+        }
+    }
+    return A;
+}
+
+Array FFT::toComplex (const Array& A)
+{
+    if (A.size (4) != 1)
+    {
+        throw std::logic_error ("real arrays must have size 1 on axis 4");
+    }
+
+    auto C = Array (A.size (0), A.size (1), A.size (2), A.size (3), 2);
+
+    for (int n = 0; n < A.size(); ++n)
+    {
+        C[2 * n] = A[n];
+    }
+    return C;
+}
+
+Array FFT::realPart (const Array& C)
+{
+    if (C.size (4) != 2)
+    {
+        throw std::logic_error ("complex arrays must have size 2 on axis 4");
+    }
+
+    auto A = Array (C.size (0), C.size (1), C.size (2), C.size (3), 1);
+
+    for (int n = 0; n < A.size(); ++n)
+    {
+        A[n] = C[2 * n];
+    }
+    return A;
+}
+
+
+
+
+// ============================================================================
+DistributedFFT::DistributedFFT (const DistributedArray& field, Decomposition decomposition) :
+field (field.getCommunicator(), field.getGlobalShape(), field.getBlockBounds(), field.getNumGhostCells())
+{
+    const auto& comm = field.getCommunicator();
+    const auto shape = field.getGlobalShape();
+
+    if (shape[4] != 2)
+    {
+        throw std::logic_error ("complex arrays must have size 2 on axis 4");
+    }
+
+    switch (decomposition)
+    {
+        case Decomposition::slabs:
+        {
+            layouts.push_back (DistributedArray (comm.createCartesian (3, {true, false, false}), shape));
+            layouts.push_back (DistributedArray (comm.createCartesian (3, {false, true, false}), shape));
+            transformedAxes = {{2, 1}, {0}};
+            break;
+        }
+        case Decomposition::pencils:
+        {
+            layouts.push_back (DistributedArray (comm.createCartesian (3, {true, true, false}), shape));
+            layouts.push_back (DistributedArray (comm.createCartesian (3, {true, false, true}), shape));
+            layouts.push_back (DistributedArray (comm.createCartesian (3, {false, true, true}), shape));
+            transformedAxes = {{2}, {1}, {0}};
+            break;
+        }
+    }
+
+    forwardPlans.push_back (this->field.planRedistribution (layouts[0]));
+
+    for (unsigned int n = 1; n < layouts.size(); ++n)
+    {
+        forwardPlans.push_back (layouts[n - 1].planRedistribution (layouts[n]));
+        inversePlans.push_back (layouts[n].planRedistribution (layouts[n - 1]));
+    }
+    inversePlans.insert (inversePlans.begin(), layouts[0].planRedistribution (this->field));
+}
+
+DistributedArray DistributedFFT::forward (const DistributedArray& input)
+{
+    forwardPlans[0].execute (input.getLocalArray(), layouts[0].getLocalArray());
+
+    for (unsigned int n = 0; n < layouts.size(); ++n)
+    {
+        if (n > 0)
+        {
+            forwardPlans[n].execute (layouts[n - 1].getLocalArray(), layouts[n].getLocalArray());
+        }
+        for (int axis : transformedAxes[n])
+        {
+            FFT::forward (layouts[n].getLocalArray(), axis);
+        }
+    }
+    return layouts.back();
+}
+
+DistributedArray DistributedFFT::inverse (const DistributedArray& spectrum)
+{
+    auto result = field;
+    layouts.back().getLocalArray() = spectrum.getLocalArray();
+
+    for (int n = layouts.size() - 1; n >= 0; --n)
+    {
+        for (int axis : transformedAxes[n])
+        {
+            FFT::inverse (layouts[n].getLocalArray(), axis);
+        }
+        auto& target = n > 0 ? layouts[n - 1].getLocalArray() : result.getLocalArray();
+        inversePlans[n].execute (layouts[n].getLocalArray(), target);
+    }
+    result.exchangeGhosts();
+    return result;
+}
+
+Array DistributedFFT::powerSpectrum (const DistributedArray& spectrum, int numBins) const
+{
+    auto P = Array (numBins);
+    auto G = spectrum.getGlobalRegion();
+    auto N = spectrum.getGlobalShape();
+    const auto& F = spectrum.getLocalArray();
+
+    auto wavenumber = [] (int i, int n) { return i <= n / 2 ? i : i - n; };
+
+    for (int i = 0; i < F.size (0); ++i)
+    for (int j = 0; j < F.size (1); ++j)
+    for (int k = 0; k < F.size (2); ++k)
+    {
+        const double ki = wavenumber (G.lower[0] + i, N[0]);
+        const double kj = wavenumber (G.lower[1] + j, N[1]);
+        const double kk = wavenumber (G.lower[2] + k, N[2]);
+        const int bin = int (std::sqrt (ki * ki + kj * kj + kk * kk) + 0.5);
+
+        if (bin >= numBins)
+        {
+            continue;
+        }
+        for (int m = 0; m < F.size (3); ++m)
+        {
+            const double re = F (i, j, k, m, 0);
+            const double im = F (i, j, k, m, 1);
+            P[bin] += re * re + im * im;
+        }
+    }
+    spectrum.getCommunicator().allreduce (P, MpiCommunicator::Reduction::sum);
+    return P;
+}
@@ -0,0 +1,179 @@
+#ifndef FFT_hpp
+#define FFT_hpp
+
+#include <complex>
+#include <vector>
+#include "Array.hpp"
+#include "DistributedArray.hpp"
+
+
+
+
+namespace Cow
+{
+    class FFT;
+    class DistributedFFT;
+
+
+    /**
+    A self-contained fast Fourier transform of a fixed size, whose prime
+    factors may only be 2, 3, and 5. It uses a mixed radix Stockham
+    algorithm, which needs no bit reversal pass.
+
+    Transforms are batched: many sequences interleaved in memory are
+    transformed together, and the innermost loop of every butterfly runs
+    over the batch, which is contiguous in memory so the compiler can
+    vectorize it.
+
+    Arrays holding complex data use the convention that axis 4 has size 2,
+    holding the real and imaginary parts. Their memory is then laid out
+    exactly like an array of std::complex<double> with the shape of axes 0
+    through 3. The static functions of this class operate on such arrays.
+    The forward transform uses the exp(-2 pi i k n / N) kernel, and the
+    inverse transform is normalized by 1 / N.
+    */
+    class FFT
+    {
+    public:
+        /**
+        Create a transform of the given size. Throws if the size has prime
+        factors other than 2, 3, and 5.
+        */
+        FFT (int size);
+
+        /**
+        Return the size of the transform.
+        */
+        int size() const { return n; }
+
+        /**
+        Return true if a transform of the given size is supported.
+        */
+        static bool isSupportedSize (int size);
+
+        /**
+        Return a transform of the given size, which is built the first time
+        that size is asked for and then shared by all callers, so its
+        twiddle factors are computed once. This may be called from several
+        threads.
+        */
+        static const FFT& plan (int size);
+
+        /**
+        Transform count interleaved sequences in place, where element i of
+        sequence b is data[i * count + b]. The transform is forward for
+        sign = -1, and an unnormalized inverse for sign = +1.
+        */
+        void execute (std::complex<double>* data, int count, int sign=-1) const;
+
+        /**
+        Same as above, but use the given work buffer of size() * count
+        elements rather than allocating one.
+        */
+        void execute (std::complex<double>* data, std::complex<double>* work, int count, int sign=-1) const;
+
+        /**
+        Transform the complex array A in place along the given axis (0
+        through 3).
+        */
+        static void forward (Array& A, int axis);
+
+        /**
+        Inverse transform the complex array A in place along the given axis,
+        normalized so that it undoes forward.
+        */
+        static void inverse (Array& A, int axis);
+
+        /**
+        Return the transform along the given axis of the real array A, which
+        must have size 1 on axis 4. Only the non-negative frequencies, N / 2 +
+        1 of them, are returned on the transformed axis, as the others are
+        their complex conjugates. Even sizes are computed with a transform
+        of half the size.
+        */
+        static Array forwardReal (const Array& A, int axis);
+
+        /**
+        Inverse of forwardReal. The size of the real output along the axis
+        must be given, since both 2 m and 2 m + 1 have m + 1 non-negative
+        frequencies.
+        */
+        static Array inverseReal (const Array& A, int axis, int size);
+
+        /**
+        Return a complex array whose real part is A, which must have size 1
+        on axis 4.
+        */
+        static Array toComplex (const Array& A);
+
+        /**
+        Return the real part of the complex array A.
+        */
+        static Array realPart (const Array& A);
+
+    private:
+        static void transform (Array& A, int axis, int sign);
+        int n;
+        std::vector<int> radices;
+        std::vector<std::vector<std::complex<double>>> twiddles;
+    };
+
+
+    /**
+    A three-dimensional FFT of a complex DistributedArray (see FFT for the
+    convention for complex arrays). The field is moved through a sequence of
+    decompositions, each of which leaves the axes being transformed whole on
+    every process, by redistribution plans that are built once when this
+    object is constructed.
+
+    With slabs, the field is first distributed along axis 0 only, where axes
+    1 and 2 are transformed, and then along axis 1 only, where axis 0 is
+    transformed. Slabs need at most one transpose, but cannot use more
+    processes than the size of the axes. With pencils, the field is moved
+    through decompositions leaving axes 2, 1, and then 0 whole. In both
+    cases the spectrum is left distributed with axis 0 whole.
+    */
+    class DistributedFFT
+    {
+    public:
+        enum class Decomposition { slabs, pencils };
+
+        /**
+        Prepare to transform fields with the same global shape and
+        decomposition as the given field. This is a collective operation.
+        */
+        DistributedFFT (const DistributedArray& field, Decomposition decomposition=Decomposition::pencils);
+
+        /**
+        Return the forward transform of the given field. This is a
+        collective operation.
+        */
+        DistributedArray forward (const DistributedArray& field);
+
+        /**
+        Return the inverse transform of a spectrum returned by forward, with
+        the decomposition and ghost width of the original field, and with its
+        ghost cells filled. This is a collective operation.
+        */
+        DistributedArray inverse (const DistributedArray& spectrum);
+
+        /**
+        Return the power spectrum, |F|^2 summed over spherical shells of
+        unit width in wavenumber space and over all components, for a
+        spectrum returned by forward. Bin b collects the wavenumbers with b -
+        1/2 <= |k| < b + 1/2, where k is in units of the fundamental mode.
+        The result is the same on all processes. This is a collective
+        operation.
+        */
+        Array powerSpectrum (const DistributedArray& spectrum, int numBins) const;
+
+    private:
+        DistributedArray field;
+        std::vector<DistributedArray> layouts;
+        std::vector<std::vector<int>> transformedAxes;
+        std::vector<MpiRedistributionPlan> forwardPlans;
+        std::vector<MpiRedistributionPlan> inversePlans;
+    };
+}
+
+#endif
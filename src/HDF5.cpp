@@ -1,8 +1,12 @@
 #include <iostream> // DEBUG
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <hdf5.h>
+#include <mpi.h>
 #include "HDF5.hpp"
+#include "DistributedArray.hpp"
 
 using namespace Cow;
 
@@ -60,10 +64,280 @@ H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setChunk (std:
     return *this;
 }
 
+H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setChunkAuto (
+    std::vector<int> shape,
+    std::vector<int> accessShape,
+    std::size_t elementBytes,
+    std::size_t targetBytes)
+{
+    if (accessShape.empty())
+    {
+        accessShape = shape;
+    }
+    if (accessShape.size() != shape.size())
+    {
+        throw std::logic_error ("access shape must have the same rank as the data set");
+    }
+
+    auto chunk = std::vector<int> (shape.size());
+    auto bytes = [&] ()
+    {
+        std::size_t b = elementBytes;
+
+        for (auto n : chunk)
+        {
+            b *= n;
+        }
+        return b;
+    };
+
+    for (unsigned int n = 0; n < shape.size(); ++n)
+    {
+        chunk[n] = std::max (1, std::min (accessShape[n], shape[n]));
+    }
+
+    while (bytes() > targetBytes)
+    {
+        auto longest = std::max_element (chunk.begin(), chunk.end());
+
+        if (*longest == 1)
+        {
+            break;
+        }
+        *longest = (*longest + 1) / 2;
+    }
+
+    for (int n = shape.size() - 1; n >= 0 && bytes() < targetBytes / 16; --n)
+    {
+        while (chunk[n] < shape[n] && bytes() < targetBytes / 16)
+        {
+            chunk[n] = std::min (2 * chunk[n], shape[n]);
+        }
+    }
+    return setChunk (chunk);
+}
+
+H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setShuffle()
+{
+    requireFilter (H5Z_FILTER_SHUFFLE, "shuffle");
+    H5Pset_shuffle (getObject()->id);
+    return *this;
+}
+
+H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setDeflate (int level)
+{
+    requireFilter (H5Z_FILTER_DEFLATE, "deflate");
+    H5Pset_deflate (getObject()->id, level);
+    return *this;
+}
+
+H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setFletcher32()
+{
+    requireFilter (H5Z_FILTER_FLETCHER32, "fletcher32");
+    H5Pset_fletcher32 (getObject()->id);
+    return *this;
+}
+
+H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setScaleOffset (int factor, bool isFloatingPoint)
+{
+    requireFilter (H5Z_FILTER_SCALEOFFSET, "scale-offset");
+    H5Pset_scaleoffset (getObject()->id, isFloatingPoint ? H5Z_SO_FLOAT_DSCALE : H5Z_SO_INT, factor);
+    return *this;
+}
+
+H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setNbit()
+{
+    requireFilter (H5Z_FILTER_NBIT, "n-bit");
+    H5Pset_nbit (getObject()->id);
+    return *this;
+}
+
+H5::PropertyList::DataSetCreate& H5::PropertyList::DataSetCreate::setFilter (
+    int filterIdentifier,
+    std::vector<unsigned int> parameters,
+    bool isOptional)
+{
+    requireFilter (filterIdentifier, "user-defined");
+    H5Pset_filter (
+        getObject()->id,
+        filterIdentifier,
+        isOptional ? H5Z_FLAG_OPTIONAL : H5Z_FLAG_MANDATORY,
+        parameters.size(),
+        parameters.data());
+    return *this;
+}
+
+bool H5::PropertyList::DataSetCreate::isFilterAvailable (int filterIdentifier)
+{
+    return H5Zfilter_avail (filterIdentifier) > 0;
+}
+
+void H5::PropertyList::DataSetCreate::requireFilter (int filterIdentifier, const char* name) const
+{
+    if (! isFilterAvailable (filterIdentifier))
+    {
+        throw std::runtime_error (std::string ("the ") + name + " filter ("
+            + std::to_string (filterIdentifier) + ") is not available");
+    }
+}
+
+
+
+
+// ============================================================================
+H5::PropertyList::FileAccess::FileAccess() : Base (H5P_FILE_ACCESS) {}
+
+H5::PropertyList::FileAccess& H5::PropertyList::FileAccess::setChunkCache (int numSlots, std::size_t numBytes, double preemption)
+{
+    // The metadata cache element count is ignored by the library since 1.8.
+    H5Pset_cache (getObject()->id, 0, numSlots, numBytes, preemption);
+    return *this;
+}
+
+H5::PropertyList::FileAccess& H5::PropertyList::FileAccess::setAlignment (std::size_t threshold, std::size_t alignment)
+{
+    H5Pset_alignment (getObject()->id, threshold, alignment);
+    return *this;
+}
+
+H5::PropertyList::FileAccess& H5::PropertyList::FileAccess::setMetaBlockSize (std::size_t numBytes)
+{
+    H5Pset_meta_block_size (getObject()->id, numBytes);
+    return *this;
+}
+
+H5::PropertyList::FileAccess& H5::PropertyList::FileAccess::setSieveBufferSize (std::size_t numBytes)
+{
+    H5Pset_sieve_buf_size (getObject()->id, numBytes);
+    return *this;
+}
+
+H5::PropertyList::FileAccess& H5::PropertyList::FileAccess::setCoreDriver (std::size_t increment, bool backingStore)
+{
+    H5Pset_fapl_core (getObject()->id, increment, backingStore);
+    return *this;
+}
+
+H5::PropertyList::FileAccess& H5::PropertyList::FileAccess::setSec2Driver()
+{
+    H5Pset_fapl_sec2 (getObject()->id);
+    return *this;
+}
+
 
 
 
 // ============================================================================
+H5::PropertyList::DataSetAccess::DataSetAccess() : Base (H5P_DATASET_ACCESS) {}
+
+H5::PropertyList::DataSetAccess& H5::PropertyList::DataSetAccess::setChunkCache (int numSlots, std::size_t numBytes, double preemption)
+{
+    H5Pset_chunk_cache (getObject()->id, numSlots, numBytes, preemption);
+    return *this;
+}
+
+
+
+
+// ============================================================================
+H5::PropertyList::DataSetTransfer::DataSetTransfer() : Base (H5P_DATASET_XFER) {}
+
+H5::PropertyList::DataSetTransfer& H5::PropertyList::DataSetTransfer::setCollective (bool collective)
+{
+#ifdef H5_HAVE_PARALLEL
+    H5Pset_dxpl_mpio (getObject()->id, collective ? H5FD_MPIO_COLLECTIVE : H5FD_MPIO_INDEPENDENT);
+    return *this;
+#else
+    if (! collective)
+    {
+        return *this;
+    }
+    throw std::runtime_error ("collective transfers need an HDF5 library built with parallel support");
+#endif
+}
+
+
+
+
+// ============================================================================
+void H5::Location::visitLinks (std::function<void (std::string, int)> callback) const
+{
+    // Only the basic object information is requested, which includes the
+    // type but not the object header, so each link costs a single lookup.
+    auto op = [] (hid_t g_id, const char *name, const H5L_info_t *info, void *op_data) -> herr_t
+    {
+        auto callback = static_cast<std::function<void (std::string, int)>*> (op_data);
+        H5O_info_t objectInfo;
+
+        if (H5Oget_info_by_name2 (g_id, name, &objectInfo, H5O_INFO_BASIC, H5P_DEFAULT) < 0)
+        {
+            (*callback) (name, H5O_TYPE_UNKNOWN);
+        }
+        else
+        {
+            (*callback) (name, objectInfo.type);
+        }
+        return 0;
+    };
+    auto idx = hsize_t (0);
+    H5Literate (getObject()->id, H5_INDEX_NAME, H5_ITER_INC, &idx, op, &callback);
+}
+
+std::vector<H5::Location::CatalogEntry> H5::Location::getCatalog (bool recursive) const
+{
+    auto catalog = std::vector<CatalogEntry>();
+
+    auto describe = [&] (std::string name, int type)
+    {
+        auto entry = CatalogEntry {name, '?', {}, '?', 0};
+
+        switch (type)
+        {
+            case H5O_TYPE_GROUP: entry.kind = 'G'; break;
+            case H5O_TYPE_NAMED_DATATYPE: entry.kind = 'T'; break;
+            case H5O_TYPE_DATASET:
+            {
+                auto dataset = getDataSet (name);
+                auto dsType = dataset.getType();
+                entry.kind = 'D';
+                entry.shape = dataset.getSpace().getShape();
+                entry.typeBytes = dsType.bytes();
+
+                switch (H5Tget_class (dsType.object->id))
+                {
+                    case H5T_INTEGER: entry.typeClass = 'i'; break;
+                    case H5T_FLOAT: entry.typeClass = 'f'; break;
+                    case H5T_STRING: entry.typeClass = 's'; break;
+                    default: break;
+                }
+                break;
+            }
+            default: break;
+        }
+        catalog.push_back (entry);
+    };
+
+    if (! recursive)
+    {
+        visitLinks (describe);
+        return catalog;
+    }
+
+    auto callback = std::function<void (std::string, int)> (describe);
+    auto op = [] (hid_t obj_id, const char *name, const H5O_info_t *info, void *op_data) -> herr_t
+    {
+        auto callback = static_cast<std::function<void (std::string, int)>*> (op_data);
+
+        if (std::strcmp (name, ".") != 0)
+        {
+            (*callback) (name, info->type);
+        }
+        return 0;
+    };
+    H5Ovisit2 (getObject()->id, H5_INDEX_NAME, H5_ITER_INC, op, &callback, H5O_INFO_BASIC);
+    return catalog;
+}
+
 bool H5::Location::hasGroup (std::string name) const
 {
     auto object = getObject();
@@ -101,10 +375,10 @@ H5::Group H5::Location::createGroup (std::string name)
     return H5::Group (new Object (id, 'G'));
 }
 
-H5::DataSet H5::Location::getDataSet (std::string name) const
+H5::DataSet H5::Location::getDataSet (std::string name, PropertyList::DataSetAccess properties) const
 {
     auto object = getObject();
-    auto datasetId = H5Dopen (object->id, name.c_str(), H5P_DEFAULT);
+    auto datasetId = H5Dopen (object->id, name.c_str(), properties.getObject()->id);
     return H5::DataSet (new Object (datasetId, 'D'));
 }
 
@@ -135,9 +409,9 @@ std::vector<std::string> H5::Location::getDataSetNames() const
 {
     std::vector<std::string> names;
 
-    iterate ([&] (std::string name)
+    visitLinks ([&] (std::string name, int type)
     {
-        if (hasDataSet (name))
+        if (type == H5O_TYPE_DATASET)
         {
             names.push_back (name);
         }
@@ -149,9 +423,9 @@ std::vector<std::string> H5::Location::getGroupNames() const
 {
     std::vector<std::string> names;
 
-    iterate ([&] (std::string name)
+    visitLinks ([&] (std::string name, int type)
     {
-        if (hasGroup (name))
+        if (type == H5O_TYPE_GROUP)
         {
             names.push_back (name);
         }
@@ -181,8 +455,15 @@ H5::DataSet H5::Location::createDataSet (
     DataType type,
     PropertyList::DataSetCreate properties)
 {
-    auto space = DataSpace (shape);
+    return createDataSet (name, DataSpace (shape), type, properties);
+}
 
+H5::DataSet H5::Location::createDataSet (
+    std::string name,
+    DataSpace space,
+    DataType type,
+    PropertyList::DataSetCreate properties)
+{
     hid_t datasetId = H5Dcreate (
         getObject()->id,
         name.c_str(),
@@ -195,6 +476,56 @@ H5::DataSet H5::Location::createDataSet (
     return H5::DataSet (new Object (datasetId, 'D'));
 }
 
+H5::Appender H5::Location::appendTo (
+    std::string name,
+    std::vector<int> sliceShape,
+    int rowsPerChunk,
+    PropertyList::DataSetCreate properties)
+{
+    if (sliceShape.size() > 4)
+    {
+        throw std::logic_error ("appended slices may have at most 4 axes");
+    }
+    if (std::any_of (sliceShape.begin(), sliceShape.end(), [] (int n) { return n <= 0; }))
+    {
+        throw std::logic_error ("appended slices may not have empty axes");
+    }
+    if (rowsPerChunk <= 0)
+    {
+        int sliceSize = 1;
+
+        for (auto n : sliceShape)
+        {
+            sliceSize *= n;
+        }
+        rowsPerChunk = std::max (1, int ((1 << 16) / (sliceSize * sizeof (double))));
+    }
+
+    auto shape = sliceShape;
+    shape.insert (shape.begin(), 0);
+
+    if (hasDataSet (name))
+    {
+        auto dataset = getDataSet (name);
+        auto existing = dataset.getSpace().getShape();
+
+        if (existing.size() != shape.size() || ! std::equal (sliceShape.begin(), sliceShape.end(), existing.begin() + 1))
+        {
+            throw std::runtime_error ("data set " + name + " does not have the slice shape being appended");
+        }
+        return Appender (dataset, sliceShape, rowsPerChunk, existing[0]);
+    }
+
+    auto maximumShape = sliceShape;
+    auto chunk = sliceShape;
+    maximumShape.insert (maximumShape.begin(), -1);
+    chunk.insert (chunk.begin(), rowsPerChunk);
+    properties.setChunk (chunk);
+
+    auto dataset = createDataSet (name, DataSpace (shape, maximumShape), DataType::nativeDouble(), properties);
+    return Appender (dataset, sliceShape, rowsPerChunk, 0);
+}
+
 void H5::Location::iterate (std::function<void (std::string)> callback) const
 {
     auto op = [] (hid_t g_id, const char *name, const H5L_info_t *info, void *op_data) -> herr_t
@@ -210,44 +541,42 @@ void H5::Location::iterate (std::function<void (std::string)> callback) const
 
 bool H5::Location::readBool (std::string name) const
 {
-    auto ds = getDataSet (name);
-    auto buffer = ds.readAll();
-    return buffer.getElement<int>(0);
+    auto buffer = getDataSet (name).readAll();
+    return buffer.getElement<unsigned char>(0);
 }
 
 int H5::Location::readInt (std::string name) const
 {
-    auto ds = getDataSet (name);
-    auto buffer = ds.readAll();
+    auto buffer = getDataSet (name).readAll();
     return buffer.getElement<int>(0);
 }
 
 double H5::Location::readDouble (std::string name) const
 {
-    auto ds = getDataSet (name);
-    auto buffer = ds.readAll();
+    auto buffer = getDataSet (name).readAll();
     return buffer.getElement<double>(0);
 }
 
 std::string H5::Location::readString (std::string name) const
 {
-    auto ds = getDataSet (name);
-    auto buffer = ds.readAll();
+    auto buffer = getDataSet (name).readAll();
     return buffer.toString();
 }
 
 Variant H5::Location::readVariant (std::string name) const
 {
-    // This approach is a bit wasteful because many temporary objects are
-    // create. However, it allows the DataType class to have say over the
-    // mapping between C and HDF5 types; if boolean was changed to some other
-    // HDF5 type, this would not break.
-    auto dsNativeType = getDataSet (name).getType();
-
-    if (dsNativeType == DataType::boolean()) return readBool (name);
-    if (dsNativeType == DataType::nativeDouble()) return readDouble (name);
-    if (dsNativeType == DataType::nativeInt()) return readInt (name);
-    if (H5Tget_class (dsNativeType.object->id) == H5T_STRING) return readString (name);
+    // This approach creates several temporary types. However, it allows the
+    // DataType class to have say over the mapping between C and HDF5 types;
+    // if boolean was changed to some other HDF5 type, this would not break.
+    // The data set is opened only once, and read in its own type.
+    auto dataset = getDataSet (name);
+    auto dsNativeType = dataset.getType();
+    auto buffer = dataset.readAll();
+
+    if (dsNativeType == DataType::boolean()) return bool (buffer.getElement<unsigned char>(0));
+    if (dsNativeType == DataType::nativeDouble()) return buffer.getElement<double>(0);
+    if (dsNativeType == DataType::nativeInt()) return buffer.getElement<int>(0);
+    if (H5Tget_class (dsNativeType.object->id) == H5T_STRING) return buffer.toString();
     throw std::runtime_error ("data set " + name + " cannot be read as a variant");
 }
 
@@ -255,9 +584,12 @@ Variant::NamedValues H5::Location::readNamedValues() const
 {
     auto values = Variant::NamedValues();
 
-    iterate ([&] (std::string name)
+    visitLinks ([&] (std::string name, int type)
     {
-        values[name] = readVariant (name);
+        if (type == H5O_TYPE_DATASET)
+        {
+            values[name] = readVariant (name);
+        }
     });
     return values;
 }
@@ -266,36 +598,70 @@ Array H5::Location::readArray (std::string name) const
 {
     auto ds = getDataSet (name);
     auto space = ds.getSpace();
-    auto shape = Array::shapeFromVector (space.getShape());
-    auto array = Array (shape);
-    ds.readBuffer (space, space, array.getAllocation());
+    auto array = Array::uninitialized (Array::shapeFromVector (space.getShape()));
+    ds.read (space, space, array.begin(), H5T_NATIVE_DOUBLE);
     return array;
 }
 
 std::vector<int> H5::Location::readVectorInt (std::string name)
 {
-    auto heap = getDataSet (name).readAll();
-    auto size = heap.size() / sizeof (int);
-    auto vect = std::vector<int> (size);
+    auto dataset = getDataSet (name);
+    auto file = dataset.getSpace();
+    auto vect = std::vector<int> (file.size());
+    dataset.read (DataSpace ({int (vect.size())}), file, vect.data(), H5T_NATIVE_INT);
+    return vect;
+}
 
-    for (unsigned int n = 0; n < size; ++n)
+std::vector<double> H5::Location::readVectorDouble (std::string name)
+{
+    auto dataset = getDataSet (name);
+    auto file = dataset.getSpace();
+    auto vect = std::vector<double> (file.size());
+    dataset.read (DataSpace ({int (vect.size())}), file, vect.data(), H5T_NATIVE_DOUBLE);
+    return vect;
+}
+
+void H5::Location::readInto (std::string name, Array& A) const
+{
+    readInto (name, A[Region()]);
+}
+
+void H5::Location::readInto (std::string name, Array::Reference reference) const
+{
+    auto ds = getDataSet (name);
+    auto file = ds.getSpace();
+
+    if (Array::shapeFromVector (file.getShape()) != reference.shape())
     {
-        vect[n] = heap.getElement<int>(n);
+        throw std::runtime_error ("data set " + name + " does not have the shape of the target region");
     }
-    return vect;
+    auto memory = DataSpace (reference.getArray().getShapeVector());
+    memory.select (reference.getRegion());
+    ds.read (memory, file, reference.getArray().begin(), H5T_NATIVE_DOUBLE);
 }
 
-std::vector<double> H5::Location::readVectorDouble (std::string name)
+void H5::Location::readInto (std::string name, double* data, std::size_t count) const
 {
-    auto heap = getDataSet (name).readAll();
-    auto size = heap.size() / sizeof (double);
-    auto vect = std::vector<double> (size);
+    auto ds = getDataSet (name);
+    auto file = ds.getSpace();
 
-    for (unsigned int n = 0; n < size; ++n)
+    if (std::size_t (file.size()) != count)
     {
-        vect[n] = heap.getElement<double>(n);
+        throw std::runtime_error ("data set " + name + " does not have " + std::to_string (count) + " elements");
     }
-    return vect;
+    ds.read (DataSpace ({int (count)}), file, data, H5T_NATIVE_DOUBLE);
+}
+
+void H5::Location::readInto (std::string name, int* data, std::size_t count) const
+{
+    auto ds = getDataSet (name);
+    auto file = ds.getSpace();
+
+    if (std::size_t (file.size()) != count)
+    {
+        throw std::runtime_error ("data set " + name + " does not have " + std::to_string (count) + " elements");
+    }
+    ds.read (DataSpace ({int (count)}), file, data, H5T_NATIVE_INT);
 }
 
 Array H5::Location::readArrays (std::vector<std::string> names, int stackedAxis,
@@ -306,10 +672,8 @@ Array H5::Location::readArrays (std::vector<std::string> names, int stackedAxis,
     auto shapeVector = getDataSet (names[0]).getSpace().getShape();
     auto sourceShape = Array::shapeFromVector (shapeVector);
 
-    if (sourceRegion == Region())
-    {
-        sourceRegion = Region::whole (sourceShape);
-    }
+    sourceRegion = sourceRegion.absolute (sourceShape);
+
     if (sourceShape[stackedAxis] != 1)
     {
         throw std::runtime_error ("cannot stack data along axis with size != 1");
@@ -318,14 +682,16 @@ Array H5::Location::readArrays (std::vector<std::string> names, int stackedAxis,
     auto targetShape = sourceRegion.shape();
     targetShape[stackedAxis] = names.size();
 
-    auto A = Array (targetShape);
+    // Each data set is read straight into its slice of the target through
+    // a memory hyperslab, so no temporary array is needed.
+    auto A = Array::uninitialized (targetShape);
     auto targetRegion = Region();
 
     for (unsigned int n = 0; n < names.size(); ++n)
     {
         targetRegion.lower[stackedAxis] = n;
         targetRegion.upper[stackedAxis] = n + 1;
-        A[targetRegion] = getDataSet (names[n])[sourceRegion].value();
+        getDataSet (names[n])[sourceRegion].readInto (A[targetRegion]);
     }
     return A;
 }
@@ -382,16 +748,129 @@ H5::DataSet H5::Location::writeVariant (std::string name, Variant value)
     }
 }
 
-H5::DataSet H5::Location::writeArray (std::string name, const Array& A)
+H5::DataSet H5::Location::writeArray (std::string name, const Array& A,
+    PropertyList::DataSetCreate properties)
 {
-    auto ds = createDataSet (name, A.getShapeVector());
+    auto ds = createDataSet (name, A.getShapeVector(), DataType::nativeDouble(), properties);
     ds.writeAll (A.getAllocation());
     return ds;    
 }
 
-H5::DataSet H5::Location::writeArray (std::string name, const Array::Reference reference)
+H5::DataSet H5::Location::writeArray (std::string name, const Array::Reference reference,
+    PropertyList::DataSetCreate properties)
 {
-    auto ds = createDataSet (name, reference.getRegion().getShapeVector());
+    auto ds = createDataSet (name, reference.getRegion().getShapeVector(), DataType::nativeDouble(), properties);
+    ds[Region()] = reference;
+    return ds;
+}
+
+/**
+Convert doubles to IEEE 754 half precision bit patterns, rounding directly
+from the double to the nearest even half. Values too large for a half
+become infinite, values too small become subnormal or zero, and NaN's stay
+NaN's. Every case is computed and the result selected, so that the loop has
+no branches and may be vectorized. Subnormals are rounded by adding a
+constant whose unit in the last place is that of a half subnormal, which
+leaves the rounding to the floating point unit.
+*/
+static void convertToFloat16 (const double* source, void* target, std::size_t count)
+{
+    const uint64_t infinity = uint64_t (0x7ff) << 52;
+    const uint64_t overflow = uint64_t (1023 + 16) << 52;
+    const uint64_t smallestNormal = uint64_t (1023 - 14) << 52;
+    const uint64_t rebias = uint64_t (1023 - 15) << 52;
+    const uint64_t subnormalMagic = uint64_t (1023 + 52 - 24) << 52;
+    const uint64_t roundDown = (uint64_t (1) << 41) - 1;
+    double magic;
+    std::memcpy (&magic, &subnormalMagic, sizeof (magic));
+    auto half = static_cast<uint16_t*> (target);
+
+    for (std::size_t n = 0; n < count; ++n)
+    {
+        uint64_t bits;
+        std::memcpy (&bits, &source[n], sizeof (bits));
+
+        const uint64_t sign = (bits >> 48) & 0x8000;
+        const uint64_t u = bits & ~(uint64_t (1) << 63);
+        double a;
+        std::memcpy (&a, &u, sizeof (a));
+
+        // Normal halves: drop 42 mantissa bits, rounding to the nearest
+        // even. A carry out of the mantissa correctly bumps the exponent.
+        const uint64_t normal = (u - rebias + roundDown + ((u >> 42) & 1)) >> 42;
+
+        const double shifted = a + magic;
+        uint64_t subnormal;
+        std::memcpy (&subnormal, &shifted, sizeof (subnormal));
+        subnormal -= subnormalMagic;
+
+        const uint64_t special = u > infinity ? 0x7e00 : 0x7c00;
+        const uint64_t result = u >= overflow ? special : u < smallestNormal ? subnormal : normal;
+        half[n] = uint16_t (result | sign);
+    }
+}
+
+static void convertToFloat32 (const double* source, void* target, std::size_t count)
+{
+    auto single = static_cast<float*> (target);
+
+    for (std::size_t n = 0; n < count; ++n)
+    {
+        single[n] = static_cast<float> (source[n]);
+    }
+}
+
+H5::DataSet H5::Location::writeArray (std::string name, const Array& A, DataType type,
+    PropertyList::DataSetCreate properties)
+{
+    auto ds = createDataSet (name, A.getShapeVector(), type, properties);
+    auto source = static_cast<const double*> (A.getAllocation().begin());
+    auto convert = std::function<void (const double*, void*, std::size_t)>();
+
+    if (type == DataType::nativeFloat())
+    {
+        convert = convertToFloat32;
+    }
+    else if (type == DataType::float16())
+    {
+        convert = convertToFloat16;
+    }
+    else
+    {
+        auto space = ds.getSpace();
+        ds.write (space, space, source, H5T_NATIVE_DOUBLE);
+        return ds;
+    }
+
+    if (A.size() == 0)
+    {
+        return ds;
+    }
+
+    // The file type is also used as the memory type, so the library does
+    // no conversion of its own; each slab is written as it is.
+    const std::size_t slabBytes = 1 << 20;
+    const std::size_t rowSize = A.size() / A.size (0);
+    const int rowsPerSlab = std::max (std::size_t (1), slabBytes / sizeof (double) / rowSize);
+    auto buffer = HeapAllocation (rowsPerSlab * rowSize * type.bytes());
+
+    for (int i0 = 0; i0 < A.size (0); i0 += rowsPerSlab)
+    {
+        int i1 = std::min (i0 + rowsPerSlab, A.size (0));
+        std::size_t count = (i1 - i0) * rowSize;
+        auto memory = DataSpace (std::vector<int> (1, count));
+        auto file = ds.getSpace();
+        file.select (Region().withRange (0, i0, i1));
+        convert (source + i0 * rowSize, buffer.begin(), count);
+        ds.write (memory, file, buffer.begin(), type.object->id);
+    }
+    return ds;
+}
+
+H5::DataSet H5::Location::writeArray (std::string name, const Array::Reference reference, DataType type,
+    PropertyList::DataSetCreate properties)
+{
+    auto ds = createDataSet (name, reference.getRegion().getShapeVector(), type, properties);
     ds[Region()] = reference;
     return ds;
 }
@@ -429,6 +908,151 @@ void H5::Location::copy (std::string name, Location& target) const
         H5P_DEFAULT, H5P_DEFAULT);
 }
 
+/**
+Return true if the file holding the given object was opened through the
+MPI-IO driver.
+*/
+static bool isOpenedWithMpio (hid_t objectId)
+{
+#ifdef H5_HAVE_PARALLEL
+    hid_t fileId = H5Iget_file_id (objectId);
+    hid_t accessProperties = H5Fget_access_plist (fileId);
+    bool mpio = H5Pget_driver (accessProperties) == H5FD_MPIO;
+    H5Pclose (accessProperties);
+    H5Fclose (fileId);
+    return mpio;
+#else
+    return false;
+#endif
+}
+
+/**
+Prepare the transfer properties, and the memory and file selections, which
+move the interior of this process's block of A to or from its hyperslab of
+the given data set.
+*/
+static H5::PropertyList::DataSetTransfer selectDistributedBlock (
+    const H5::Object* location,
+    const DistributedArray& A,
+    H5::DataSpace& memory,
+    H5::DataSpace& file)
+{
+    auto transfer = H5::PropertyList::DataSetTransfer();
+
+    if (isOpenedWithMpio (location->id))
+    {
+        transfer.setCollective();
+    }
+    else if (A.getCommunicator().size() > 1)
+    {
+        throw std::logic_error ("distributed arrays on more than one process need a file opened with an MpiCommunicator");
+    }
+
+    auto interior = A.getInterior();
+
+    if (interior.size() == 0)
+    {
+        // Processes with empty blocks still take part in collective transfers.
+        memory.selectNone();
+        file.selectNone();
+    }
+    else
+    {
+        memory.select (interior);
+        file.select (A.getGlobalRegion());
+    }
+    return transfer;
+}
+
+H5::DataSet H5::Location::writeDistributedArray (std::string name, const DistributedArray& A)
+{
+    const auto& local = A.getLocalArray();
+    auto ds = createDataSet (name, Array::vectorFromShape (A.getGlobalShape()));
+    auto memory = DataSpace (local.getShapeVector());
+    auto file = ds.getSpace();
+    auto transfer = selectDistributedBlock (getObject(), A, memory, file);
+    ds.writeBuffer (memory, file, local.getAllocation(), transfer);
+    return ds;
+}
+
+void H5::Location::readDistributedArray (std::string name, DistributedArray& A) const
+{
+    auto& local = A.getLocalArray();
+    auto ds = getDataSet (name);
+    auto memory = DataSpace (local.getShapeVector());
+    auto file = ds.getSpace();
+
+    if (file.getShape() != Array::vectorFromShape (A.getGlobalShape()))
+    {
+        throw std::runtime_error ("data set " + name + " does not have the global shape of the distributed array");
+    }
+    auto transfer = selectDistributedBlock (getObject(), A, memory, file);
+    ds.readBuffer (memory, file, local.getAllocation(), transfer);
+}
+
+H5::DataSet H5::Location::createVirtualDataSet (std::string name, std::vector<int> shape,
+    std::vector<VirtualSource> sources, DataType type)
+{
+    auto properties = PropertyList::DataSetCreate();
+
+    for (const auto& source : sources)
+    {
+        // An equal lower and upper bound on an axis of the data set is an
+        // empty range, although [0, 0) would otherwise be taken as relative
+        // and cover the whole axis. Such a source supplies nothing.
+        auto isEmpty = false;
+
+        for (unsigned int axis = 0; axis < shape.size(); ++axis)
+        {
+            isEmpty |= source.region.upper[axis] == source.region.lower[axis];
+        }
+
+        if (isEmpty)
+        {
+            continue;
+        }
+
+        auto region = source.region.absolute (shape);
+        auto sourceShape = std::vector<int>();
+
+        for (unsigned int axis = 0; axis < shape.size(); ++axis)
+        {
+            if (region.stride[axis] != 1)
+            {
+                throw std::logic_error ("virtual data set regions must have unit strides");
+            }
+            sourceShape.push_back (region.upper[axis] - region.lower[axis]);
+        }
+        auto virtualSpace = DataSpace (shape);
+        auto sourceSpace = DataSpace (sourceShape);
+        virtualSpace.select (region);
+
+        if (H5Pset_virtual (
+            properties.getObject()->id,
+            virtualSpace.object->id,
+            source.fileName.c_str(),
+            source.dataSetName.c_str(),
+            sourceSpace.object->id) < 0)
+        {
+            throw std::runtime_error ("could not map " + source.fileName + ":" + source.dataSetName
+                + " into virtual data set " + name);
+        }
+    }
+    return createDataSet (name, shape, type, properties);
+}
+
+H5::DataSet H5::Location::createVirtualDataSet (std::string name, const DistributedArray& A,
+    std::function<std::string (int)> fileName, std::string dataSetName)
+{
+    auto sources = std::vector<VirtualSource>();
+
+    for (int rank = 0; rank < A.getCommunicator().size(); ++rank)
+    {
+        sources.push_back ({fileName (rank), dataSetName, A.getGlobalRegion (rank)});
+    }
+    return createVirtualDataSet (name, Array::vectorFromShape (A.getGlobalShape()), sources);
+}
+
 
 
 
@@ -437,7 +1061,8 @@ H5::DataSet::DataSet (Object* object) : object (object)
 {
 
 }
-void H5::DataSet::readBuffer (DataSpace memory, DataSpace file, HeapAllocation& buffer) const
+void H5::DataSet::readBuffer (DataSpace memory, DataSpace file, HeapAllocation& buffer,
+    PropertyList::DataSetTransfer transfer) const
 {
     DataType type = getType();
     H5Dread (
@@ -445,10 +1070,32 @@ void H5::DataSet::readBuffer (DataSpace memory, DataSpace file, HeapAllocation&
         type.object->id,
         memory.object->id,
         file.object->id,
-        H5P_DEFAULT,
+        transfer.getObject()->id,
         buffer.begin());   
 }
 
+void H5::DataSet::read (DataSpace memory, DataSpace file, void* data, long long memoryType) const
+{
+    H5Dread (
+        object->id,
+        memoryType,
+        memory.object->id,
+        file.object->id,
+        H5P_DEFAULT,
+        data);
+}
+
+void H5::DataSet::write (DataSpace memory, DataSpace file, const void* data, long long memoryType) const
+{
+    H5Dwrite (
+        object->id,
+        memoryType,
+        memory.object->id,
+        file.object->id,
+        H5P_DEFAULT,
+        data);
+}
+
 HeapAllocation H5::DataSet::readAll() const
 {
     auto space = getSpace();
@@ -457,7 +1104,8 @@ HeapAllocation H5::DataSet::readAll() const
     return buffer;
 }
 
-void H5::DataSet::writeBuffer (DataSpace memory, DataSpace file, const HeapAllocation& buffer) const
+void H5::DataSet::writeBuffer (DataSpace memory, DataSpace file, const HeapAllocation& buffer,
+    PropertyList::DataSetTransfer transfer) const
 {
     DataType type = getType();
     H5Dwrite (
@@ -465,7 +1113,7 @@ void H5::DataSet::writeBuffer (DataSpace memory, DataSpace file, const HeapAlloc
         type.object->id,
         memory.object->id,
         file.object->id,
-        H5P_DEFAULT,
+        transfer.getObject()->id,
         buffer.begin());
 }
 
@@ -488,6 +1136,21 @@ H5::DataType H5::DataSet::getType() const
     return new Object (typeId, 'T');
 }
 
+std::size_t H5::DataSet::getStorageSize() const
+{
+    return H5Dget_storage_size (object->id);
+}
+
+void H5::DataSet::extend (std::vector<int> shape)
+{
+    auto hdims = std::vector<hsize_t> (shape.begin(), shape.end());
+
+    if (H5Dset_extent (object->id, hdims.data()) < 0)
+    {
+        throw std::runtime_error ("could not change the shape of the data set; is it chunked, with room in its maximum shape?");
+    }
+}
+
 H5::DataSet::Reference H5::DataSet::operator[] (Region region)
 {
     return Reference (*this, region.absolute (getSpace().getShape()));
@@ -504,12 +1167,27 @@ H5::DataSet::Reference::Reference (DataSet& D, Region R) : D(D), R(R)
 
 Array H5::DataSet::Reference::value() const
 {
-    auto targetArray = Array (R.shape());
-    auto memory = DataSpace (targetArray.getShapeVector());
+    auto targetArray = Array::uninitialized (R.shape());
+    readInto (targetArray);
+    return targetArray;
+}
+
+void H5::DataSet::Reference::readInto (Array& A) const
+{
+    readInto (A[Region()]);
+}
+
+void H5::DataSet::Reference::readInto (Array::Reference target) const
+{
+    if (target.shape() != R.shape())
+    {
+        throw std::runtime_error ("data set selection does not have the shape of the target region");
+    }
+    auto memory = DataSpace (target.getArray().getShapeVector());
     auto file = D.getSpace();
+    memory.select (target.getRegion());
     file.select (R);
-    D.readBuffer (memory, file, targetArray.getAllocation());
-    return targetArray;
+    D.read (memory, file, target.getArray().begin(), H5T_NATIVE_DOUBLE);
 }
 
 const Array& H5::DataSet::Reference::operator= (Array& A)
@@ -524,7 +1202,7 @@ const Array::Reference& H5::DataSet::Reference::operator= (const Array::Referenc
     auto file = D.getSpace();
     file.select (R);
     memory.select (ref.getRegion());
-    D.writeBuffer (memory, file, ref.getArray().getAllocation());
+    D.write (memory, file, ref.getArray().getAllocation().begin(), H5T_NATIVE_DOUBLE);
     return ref;
 }
 
@@ -552,6 +1230,24 @@ H5::DataSpace::DataSpace (std::vector<int> shape)
     object.reset (new Object (id, 'S'));
 }
 
+H5::DataSpace::DataSpace (std::vector<int> shape, std::vector<int> maximumShape)
+{
+    if (shape.size() != maximumShape.size())
+    {
+        throw std::logic_error ("maximum shape must have the same rank as the shape");
+    }
+    std::vector<hsize_t> current_dims;
+    std::vector<hsize_t> maximum_dims;
+
+    for (unsigned int n = 0; n < shape.size(); ++n)
+    {
+        current_dims.push_back (shape[n]);
+        maximum_dims.push_back (maximumShape[n] < 0 ? H5S_UNLIMITED : maximumShape[n]);
+    }
+    hid_t id = H5Screate_simple (shape.size(), &current_dims[0], &maximum_dims[0]);
+    object.reset (new Object (id, 'S'));
+}
+
 H5::DataSpace::DataSpace (Object* object) : object (object)
 {
 
@@ -577,6 +1273,26 @@ std::vector<int> H5::DataSpace::getShape() const
     return dims;
 }
 
+std::vector<int> H5::DataSpace::getMaximumShape() const
+{
+    int ndims = H5Sget_simple_extent_ndims (object->id);
+
+    if (ndims <= 0)
+    {
+        return std::vector<int>();
+    }
+
+    std::vector<hsize_t> hdims (ndims);
+    H5Sget_simple_extent_dims (object->id, nullptr, &hdims[0]);
+    std::vector<int> dims;
+
+    for (auto n : hdims)
+    {
+        dims.push_back (n == H5S_UNLIMITED ? -1 : int (n));
+    }
+    return dims;
+}
+
 int H5::DataSpace::size() const
 {
     int S = 1;
@@ -613,6 +1329,11 @@ void H5::DataSpace::select (Region R)
         &block[0]);
 }
 
+void H5::DataSpace::selectNone()
+{
+    H5Sselect_none (object->id);
+}
+
 
 
 
@@ -635,6 +1356,21 @@ H5::DataType H5::DataType::nativeDouble()
     return new Object (id, 'T');
 }
 
+H5::DataType H5::DataType::nativeFloat()
+{
+    hid_t id = H5Tcopy (H5T_NATIVE_FLOAT);
+    return new Object (id, 'T');
+}
+
+H5::DataType H5::DataType::float16()
+{
+    hid_t id = H5Tcopy (H5T_IEEE_F32LE);
+    H5Tset_fields (id, 15, 10, 5, 0, 10);
+    H5Tset_size (id, 2);
+    H5Tset_ebias (id, 15);
+    return new Object (id, 'T');
+}
+
 H5::DataType H5::DataType::nativeString (int length)
 {
     hid_t id = H5Tcopy (H5T_C_S1);
@@ -667,28 +1403,151 @@ bool H5::DataType::operator== (const DataType& other) const
 
 
 // ============================================================================
-H5::File::File (std::string name, const char* mode)
+H5::Appender::Appender (DataSet dataset, std::vector<int> sliceShape, int rowsPerChunk, int numRows) :
+dataset (new DataSet (dataset)),
+sliceShape (sliceShape),
+numBuffered (0),
+numRows (numRows)
+{
+    auto bufferShape = Array::shapeFromVector (sliceShape);
+    std::copy (bufferShape.begin(), bufferShape.end() - 1, bufferShape.begin() + 1);
+    bufferShape[0] = rowsPerChunk;
+    buffer = Array::uninitialized (bufferShape);
+}
+
+H5::Appender::Appender (Appender&& other) = default;
+
+H5::Appender::~Appender()
+{
+    if (dataset)
+    {
+        try
+        {
+            flush();
+        }
+        catch (...)
+        {
+            // Errors are reported by an explicit call to flush.
+        }
+    }
+}
+
+void H5::Appender::append (const Array& slice)
+{
+    const int sliceSize = buffer.size() / buffer.size (0);
+
+    if (slice.shape() != Array::shapeFromVector (sliceShape))
+    {
+        throw std::logic_error ("appended array does not have the slice shape");
+    }
+    std::memcpy (
+        buffer.begin() + numBuffered * sliceSize,
+        slice.getAllocation().begin(),
+        sliceSize * sizeof (double));
+
+    if (++numBuffered == buffer.size (0))
+    {
+        flush();
+    }
+}
+
+void H5::Appender::append (double value)
+{
+    if (! sliceShape.empty())
+    {
+        throw std::logic_error ("single values may only be appended to a data set of scalars");
+    }
+    buffer[numBuffered] = value;
+
+    if (++numBuffered == buffer.size (0))
+    {
+        flush();
+    }
+}
+
+void H5::Appender::flush()
+{
+    if (numBuffered == 0)
+    {
+        return;
+    }
+    auto shape = sliceShape;
+    shape.insert (shape.begin(), numRows + numBuffered);
+    dataset->extend (shape);
+
+    auto memory = DataSpace (buffer.getShapeVector());
+    auto file = dataset->getSpace();
+    memory.select (Region().withRange (0, 0, numBuffered));
+    file.select (Region().withRange (0, numRows, numRows + numBuffered));
+    dataset->writeBuffer (memory, file, buffer.getAllocation());
+
+    numRows += numBuffered;
+    numBuffered = 0;
+}
+
+int H5::Appender::size() const
+{
+    return numRows + numBuffered;
+}
+
+H5::DataSet H5::Appender::getDataSet() const
+{
+    return *dataset;
+}
+
+
+
+
+// ============================================================================
+H5::File::File (std::string name, const char* mode, PropertyList::FileAccess properties)
+{
+    open (name, mode, properties.getObject()->id);
+}
+
+H5::File::File (std::string name, const char* mode, const MpiCommunicator& communicator,
+    PropertyList::FileAccess properties)
+{
+#ifdef H5_HAVE_PARALLEL
+    hid_t accessProperties = H5Pcopy (properties.getObject()->id);
+    H5Pset_fapl_mpio (accessProperties, communicator.getMpiComm(), MPI_INFO_NULL);
+    open (name, mode, accessProperties);
+    H5Pclose (accessProperties);
+#else
+    throw std::runtime_error ("cannot open " + name + " with a communicator: HDF5 was built without parallel support");
+#endif
+}
+
+bool H5::File::isParallelSupported()
+{
+#ifdef H5_HAVE_PARALLEL
+    return true;
+#else
+    return false;
+#endif
+}
+
+void H5::File::open (std::string name, const char* mode, long long accessProperties)
 {
     if (std::strcmp (mode, "r") == 0)
     {
-        hid_t id = H5Fopen (name.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        hid_t id = H5Fopen (name.c_str(), H5F_ACC_RDONLY, accessProperties);
         object.reset (new Object (id, 'F'));
         return;        
     }
     if (std::strcmp (mode, "a") == 0)
     {
-        hid_t id = H5Fopen (name.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+        hid_t id = H5Fopen (name.c_str(), H5F_ACC_RDWR, accessProperties);
         object.reset (new Object (id, 'F'));
         return;        
     }
     if (std::strcmp (mode, "w") == 0)
     {
-        hid_t id = H5Fcreate (name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+        hid_t id = H5Fcreate (name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, accessProperties);
         object.reset (new Object (id, 'F'));
         return;
     }
     assert (false);
-};
+}
 
 int H5::File::getObjectCount() const
 {
@@ -12,6 +12,9 @@
 
 namespace Cow
 {
+    class DistributedArray;
+    class MpiCommunicator;
+
     namespace H5
     {
         // ====================================================================
@@ -19,6 +22,7 @@ namespace Cow
         // ====================================================================
 
 
+        class Appender;
         class DataSet;
         class DataSpace;
         class DataType;
@@ -74,6 +78,172 @@ namespace Cow
             public:
                 DataSetCreate();
                 DataSetCreate& setChunk (std::vector<int> dims);
+
+                /**
+                Set the chunk shape to one chosen for a data set of the given
+                shape and element size, which is read or written in pieces of
+                the given access shape (the whole data set if it is empty).
+                The chunk starts as the access shape; it is halved along its
+                longest axis while it is larger than targetBytes, and doubled
+                along its trailing axes, which are contiguous, while it is
+                smaller than a sixteenth of that, so that each chunk is large
+                enough to be worth compressing but small enough that a
+                partial access does not read much more than it needs. The
+                default target is the size of HDF5's default chunk cache.
+                */
+                DataSetCreate& setChunkAuto (
+                    std::vector<int> shape,
+                    std::vector<int> accessShape={},
+                    std::size_t elementBytes=sizeof (double),
+                    std::size_t targetBytes=1 << 20);
+
+                // The methods below append a filter to the pipeline applied
+                // to each chunk, in the order they are called; for example,
+                // the shuffle filter should be added before deflate. Filters
+                // need a chunked layout, and throw if they are not available
+                // in the HDF5 library.
+
+                /**
+                Reorder the bytes of each chunk so that the bytes of equal
+                significance are stored together, which helps a compressor
+                that follows.
+                */
+                DataSetCreate& setShuffle();
+
+                /**
+                Compress each chunk with zlib, at the given level from 1
+                (fastest) to 9 (smallest).
+                */
+                DataSetCreate& setDeflate (int level=6);
+
+                /**
+                Store a Fletcher32 checksum with each chunk, which is checked
+                when the chunk is read.
+                */
+                DataSetCreate& setFletcher32();
+
+                /**
+                Store each chunk as offsets from its minimum value, using as
+                few bits as possible. For floating point data this is lossy,
+                keeping the given number of decimal digits after the point;
+                for integer data, the factor is the number of bits to keep,
+                or 0 to let the library choose it losslessly.
+                */
+                DataSetCreate& setScaleOffset (int factor, bool isFloatingPoint=true);
+
+                /**
+                Pack each element into the number of bits given by the
+                precision of the data set's type, which is only useful for
+                types of reduced precision.
+                */
+                DataSetCreate& setNbit();
+
+                /**
+                Add a filter registered with the HDF5 library (for example by
+                a plugin) with the given identifier and parameters. If the
+                filter is optional, chunks it fails on are stored unfiltered.
+                */
+                DataSetCreate& setFilter (int filterIdentifier,
+                    std::vector<unsigned int> parameters={},
+                    bool isOptional=false);
+
+                /**
+                Return true if the filter with the given identifier is
+                available to the HDF5 library.
+                */
+                static bool isFilterAvailable (int filterIdentifier);
+
+            private:
+                void requireFilter (int filterIdentifier, const char* name) const;
+            };
+
+            /**
+            A class that encapuslates an HDF5 property list created with
+            H5P_FILE_ACCESS.
+            */
+            class FileAccess : public Base
+            {
+            public:
+                FileAccess();
+
+                /**
+                Set the default raw data chunk cache of the file's data sets:
+                the number of hash table slots (ideally a prime about 100
+                times the number of chunks that fit in the cache), the size
+                of the cache in bytes, and the preemption policy between 0
+                and 1, where 1 evicts chunks that have been fully read or
+                written before any others.
+                */
+                FileAccess& setChunkCache (int numSlots, std::size_t numBytes, double preemption=0.75);
+
+                /**
+                Align every object at least threshold bytes large to a
+                multiple of the given alignment in the file, such as the
+                stripe size of a parallel file system.
+                */
+                FileAccess& setAlignment (std::size_t threshold, std::size_t alignment);
+
+                /**
+                Set the minimum size of the blocks in which metadata are
+                allocated, so that small metadata objects are aggregated.
+                */
+                FileAccess& setMetaBlockSize (std::size_t numBytes);
+
+                /**
+                Set the size of the buffer used to read and write contiguous
+                data sets in large pieces when the selection is sparse.
+                */
+                FileAccess& setSieveBufferSize (std::size_t numBytes);
+
+                /**
+                Keep the file in memory (the core driver), growing it by the
+                given increment. If backingStore is true, it is written to
+                disk when closed.
+                */
+                FileAccess& setCoreDriver (std::size_t increment=1 << 20, bool backingStore=true);
+
+                /**
+                Use the sec2 driver, with unbuffered POSIX I/O calls. This is
+                the library's default.
+                */
+                FileAccess& setSec2Driver();
+            };
+
+            /**
+            A class that encapuslates an HDF5 property list created with
+            H5P_DATASET_ACCESS.
+            */
+            class DataSetAccess : public Base
+            {
+            public:
+                DataSetAccess();
+
+                /**
+                Set the chunk cache of this data set, overriding the default
+                given by FileAccess::setChunkCache. The arguments have the
+                same meaning.
+                */
+                DataSetAccess& setChunkCache (int numSlots, std::size_t numBytes, double preemption=0.75);
+            };
+
+            /**
+            A class that encapuslates an HDF5 property list created with
+            H5P_DATASET_XFER.
+            */
+            class DataSetTransfer : public Base
+            {
+            public:
+                DataSetTransfer();
+
+                /**
+                Make reads and writes with these properties collective
+                (H5FD_MPIO_COLLECTIVE), so that MPI-IO may aggregate the
+                requests of all processes into large contiguous accesses.
+                Every process of the file's communicator must then take part
+                in each transfer, if need be with an empty selection. Throws
+                if the HDF5 library was built without parallel support.
+                */
+                DataSetTransfer& setCollective (bool collective=true);
             };
         };
 
@@ -87,8 +257,16 @@ namespace Cow
             static DataType boolean();
             static DataType nativeInt();
             static DataType nativeDouble();
+            static DataType nativeFloat();
             static DataType nativeString (int length);
 
+            /**
+            Return an IEEE 754 half precision type (1 sign bit, 5 exponent
+            bits, and 10 mantissa bits). It has no native C++ counterpart;
+            the library converts it to and from double on reads and writes.
+            */
+            static DataType float16();
+
             /** Return the size in bytes of this data type. */
             std::size_t bytes() const;
 
@@ -116,6 +294,47 @@ namespace Cow
         class Location : public virtual ObjectProvider
         {
         public:
+            /**
+            A description of one object below a location, returned by
+            getCatalog. The kind is 'G' for groups, 'D' for data sets, 'T'
+            for committed data types, and '?' otherwise. For data sets, the
+            shape is that of the data space (empty for scalars), and the type
+            class is 'i' for integers, 'f' for floating point numbers, 's'
+            for strings, or '?' otherwise.
+            */
+            struct CatalogEntry
+            {
+                std::string name;
+                char kind;
+                std::vector<int> shape;
+                char typeClass;
+                std::size_t typeBytes;
+            };
+
+            /**
+            One source of a virtual data set: the data set in another file
+            which supplies the given region of the virtual data set. The
+            source data set must have the shape of the region, which may be
+            relative or absolute but must have unit strides. A range whose
+            lower and upper bounds are equal, on any axis of the virtual data
+            set, is empty, even [0, 0), and the source is then left out.
+            */
+            struct VirtualSource
+            {
+                std::string fileName;
+                std::string dataSetName;
+                Region region;
+            };
+
+            /**
+            Return a description of every object directly below this
+            location, or of every object in the tree below it if recursive
+            is true, in which case names are paths relative to this
+            location. The objects are found in a single pass of H5Literate
+            or H5Ovisit, and each data set found is opened once.
+            */
+            std::vector<CatalogEntry> getCatalog (bool recursive=false) const;
+
             /**
             Return true if the object has a group with the given name.
             */
@@ -162,7 +381,8 @@ namespace Cow
             Get a data set at this location with the given name. The data set
             must already exist.
             */
-            DataSet getDataSet (std::string name) const;
+            DataSet getDataSet (std::string name,
+                PropertyList::DataSetAccess properties=PropertyList::DataSetAccess()) const;
 
             /**
             Create a scalar data set at this location with the given type.
@@ -177,6 +397,26 @@ namespace Cow
                 DataType type=DataType::nativeDouble(),
                 PropertyList::DataSetCreate properties=PropertyList::DataSetCreate());
 
+            /**
+            Create a data set whose space is extensible (see DataSpace). The
+            properties must set a chunk shape.
+            */
+            DataSet createDataSet (std::string name, DataSpace space,
+                DataType type=DataType::nativeDouble(),
+                PropertyList::DataSetCreate properties=PropertyList::DataSetCreate());
+
+            /**
+            Return an appender to the data set with the given name, which is
+            created if it does not exist, with the given slice shape, zero
+            length along its first axis, and an unlimited first axis. If it
+            does exist, its shape following the first axis must be the slice
+            shape, and appends go after its current contents. The slice shape
+            may not have empty axes. See Appender for the other arguments; a
+            chunk shape is set on the given properties.
+            */
+            Appender appendTo (std::string name, std::vector<int> sliceShape={}, int rowsPerChunk=0,
+                PropertyList::DataSetCreate properties=PropertyList::DataSetCreate());
+
             /**
             Iterate over all HDF5 locations below this one, invoking the given
             callback with the name of the location.
@@ -190,6 +430,13 @@ namespace Cow
             */
             Array readArrays (std::vector<std::string> names, int stackedAxis, Cow::Region sourceRegion=Region()) const;
 
+            /**
+            Read a scalar parameter. readVariant opens the data set once, and
+            takes both its type and its value from that handle. The const
+            read functions keep no state in the location, and close what they
+            open before returning, so they may be called on one location from
+            several threads when the HDF5 library is thread-safe.
+            */
             bool readBool (std::string name) const;
             int readInt (std::string name) const;
             double readDouble (std::string name) const;
@@ -200,13 +447,50 @@ namespace Cow
             std::vector<int> readVectorInt (std::string name);
             std::vector<double> readVectorDouble (std::string name);
 
+            /**
+            Read the whole data set with the given name into A, which must
+            have the data set's shape. No temporary buffer is made.
+            */
+            void readInto (std::string name, Array& A) const;
+
+            /**
+            Read the whole data set with the given name into the referenced
+            region of an array, which must have the data set's shape. The data
+            go straight to the region through a memory hyperslab.
+            */
+            void readInto (std::string name, Array::Reference reference) const;
+
+            /**
+            Read the whole data set with the given name into a contiguous
+            buffer of count elements, converting them to double or int. The
+            count must be the number of elements in the data set.
+            */
+            void readInto (std::string name, double* data, std::size_t count) const;
+            void readInto (std::string name, int* data, std::size_t count) const;
+
             DataSet writeBool (std::string name, bool value);
             DataSet writeInt (std::string name, int value);
             DataSet writeDouble (std::string name, double value);
             DataSet writeString (std::string name, std::string value);
             DataSet writeVariant (std::string name, Variant value);
-            DataSet writeArray (std::string name, const Array& A);
-            DataSet writeArray (std::string name, const Array::Reference reference);
+            DataSet writeArray (std::string name, const Array& A,
+                PropertyList::DataSetCreate properties=PropertyList::DataSetCreate());
+            DataSet writeArray (std::string name, const Array::Reference reference,
+                PropertyList::DataSetCreate properties=PropertyList::DataSetCreate());
+
+            /**
+            Write an array to a data set of the given floating point type,
+            such as DataType::nativeFloat() or DataType::float16() to store
+            it with reduced precision. Conversion from double is done in
+            slabs of about 1 MB along the first axis, each converted into a
+            small buffer and written as a hyperslab, so the whole array is
+            never converted at once. Reading the data set (readArray, for
+            example) converts it back to double.
+            */
+            DataSet writeArray (std::string name, const Array& A, DataType type,
+                PropertyList::DataSetCreate properties=PropertyList::DataSetCreate());
+            DataSet writeArray (std::string name, const Array::Reference reference, DataType type,
+                PropertyList::DataSetCreate properties=PropertyList::DataSetCreate());
             DataSet writeVectorInt (std::string name, const std::vector<int>& value);
             DataSet writeVectorDouble (std::string name, const std::vector<double>& value);
 
@@ -215,6 +499,53 @@ namespace Cow
             location of the same name under the target.
             */
             void copy (std::string name, Location& target) const;
+
+            /**
+            Create a data set with the global shape of A, and write the
+            interior of each process's block into its hyperslab. If the file
+            was opened with an MpiCommunicator, every process of A's
+            communicator must call this, and the data is written in a single
+            collective MPI-IO transfer. Otherwise A's communicator must have
+            one process.
+            */
+            DataSet writeDistributedArray (std::string name, const DistributedArray& A);
+
+            /**
+            Read each process's block of a data set written by
+            writeDistributedArray into the interior of A, which must have the
+            data set's global shape but may be decomposed differently. Ghost
+            cells are not filled. The requirements on the file are the same
+            as for writeDistributedArray.
+            */
+            void readDistributedArray (std::string name, DistributedArray& A) const;
+
+            /**
+            Create a virtual data set of the given shape, mapping each source
+            data set onto its region. No data is copied: the virtual data set
+            is opened with getDataSet like any other, and reads of it (a
+            hyperslab Reference, for example) go to the source files, which
+            are opened when needed. Relative source file names are looked up
+            relative to the current directory, then to the directory of this
+            location's file. Elements covered by no source read as zero.
+            */
+            DataSet createVirtualDataSet (std::string name, std::vector<int> shape,
+                std::vector<VirtualSource> sources, DataType type=DataType::nativeDouble());
+
+            /**
+            Create a virtual data set with the global shape of A, assembled
+            from one file per process, each holding that process's block
+            (the interior of its local array) as a data set with the given
+            name. The file name of each process is returned by fileName for
+            its rank, and its region is found from its cartesian coordinates
+            and A's block bounds. Processes with empty blocks are left out,
+            and need not write a file. This makes no MPI calls, so it is normally
+            done by one process, once every file has been written.
+            */
+            DataSet createVirtualDataSet (std::string name, const DistributedArray& A,
+                std::function<std::string (int)> fileName, std::string dataSetName);
+
+        private:
+            void visitLinks (std::function<void (std::string, int)> callback) const;
         };
 
 
@@ -244,6 +575,19 @@ namespace Cow
                 */
                 Reference (DataSet& D, Region R);
                 Array value() const;
+
+                /**
+                Read the referenced selection into A, which must have its
+                shape.
+                */
+                void readInto (Array& A) const;
+
+                /**
+                Read the referenced selection into a region of another array,
+                of the same shape, through a memory hyperslab.
+                */
+                void readInto (Array::Reference target) const;
+
                 const Array& operator= (Array& A);
                 const Array::Reference& operator= (const Array::Reference& ref);
             private:
@@ -254,7 +598,8 @@ namespace Cow
             /**
             General read function.
             */
-            void readBuffer (DataSpace memory, DataSpace file, HeapAllocation& buffer) const;
+            void readBuffer (DataSpace memory, DataSpace file, HeapAllocation& buffer,
+                PropertyList::DataSetTransfer transfer=PropertyList::DataSetTransfer()) const;
 
             /**
             Read all of the data set and return it as a new heap allocation.
@@ -264,7 +609,8 @@ namespace Cow
             /**
             General write function.
             */
-            void writeBuffer (DataSpace memory, DataSpace file, const HeapAllocation& buffer) const;
+            void writeBuffer (DataSpace memory, DataSpace file, const HeapAllocation& buffer,
+                PropertyList::DataSetTransfer transfer=PropertyList::DataSetTransfer()) const;
 
             /**
             Write a buffer into the whole data space. The buffer size must
@@ -282,6 +628,20 @@ namespace Cow
             */
             DataType getType() const;
 
+            /**
+            Return the number of bytes the data set occupies in the file,
+            after any filters have been applied.
+            */
+            std::size_t getStorageSize() const;
+
+            /**
+            Change the shape of the data set, within the maximum shape of its
+            space, through H5Dset_extent. Data outside the new shape is lost.
+            A std::runtime_error is raised if the data set cannot take the
+            new shape.
+            */
+            void extend (std::vector<int> shape);
+
             /**
             Return a reference to a subset of this data set. It is the
             caller's responsibility to ensure this data set lives at least as
@@ -293,6 +653,8 @@ namespace Cow
         private:
             friend class Location;
             DataSet (Object* object);
+            void read (DataSpace memory, DataSpace file, void* data, long long memoryType) const;
+            void write (DataSpace memory, DataSpace file, const void* data, long long memoryType) const;
             std::shared_ptr<Object> object;
         };
 
@@ -313,6 +675,19 @@ namespace Cow
             */
             DataSpace (std::vector<int> shape);
 
+            /**
+            Construct a DataSpace of the given shape, which may be extended
+            up to the given maximum shape. Negative entries of the maximum
+            shape mean the axis is unlimited. Data sets with extensible
+            spaces must be chunked.
+            */
+            DataSpace (std::vector<int> shape, std::vector<int> maximumShape);
+
+            /**
+            Get the data space's maximum shape, with -1 for unlimited axes.
+            */
+            std::vector<int> getMaximumShape() const;
+
             /**
             Get the data space's shape.
             */
@@ -330,6 +705,11 @@ namespace Cow
             */
             void select (Region R);
 
+            /**
+            Clear the active selection, so that no elements are selected.
+            */
+            void selectNone();
+
         private:
             friend class DataSet;
             friend class Location;
@@ -338,6 +718,69 @@ namespace Cow
         };
 
 
+        /**
+        A class that appends slices to a data set whose first axis is
+        unlimited, such as a time series of per-step diagnostics or probe
+        signals. Appended slices are copied into a buffer that holds one
+        chunk's worth of rows, and written in a single extend and hyperslab
+        write when it is full, when flush is called, and when the appender
+        goes out of scope. The data set's chunks are rowsPerChunk slices
+        long; if that is 0, it is chosen so that chunks hold about 64 KB.
+        */
+        class Appender
+        {
+        public:
+            /**
+            Destructor. Flushes the buffered slices, but cannot report an
+            error in doing so; call flush first to find out about one.
+            */
+            ~Appender();
+
+            /**
+            Move constructor. The moved-from appender no longer refers to a
+            data set.
+            */
+            Appender (Appender&& other);
+
+            /**
+            Append a slice, whose shape must be the slice shape.
+            */
+            void append (const Array& slice);
+
+            /**
+            Append a single value, to a data set whose slice shape is empty.
+            */
+            void append (double value);
+
+            /**
+            Write the buffered slices to the data set. This raises an error
+            if the data set cannot be extended, as when it was not created
+            with an unlimited first axis.
+            */
+            void flush();
+
+            /**
+            Return the number of slices in the data set, including those not
+            yet flushed.
+            */
+            int size() const;
+
+            /**
+            Return the data set being appended to.
+            */
+            DataSet getDataSet() const;
+
+        private:
+            friend class Location;
+            Appender (DataSet dataset, std::vector<int> sliceShape, int rowsPerChunk, int numRows);
+            std::unique_ptr<DataSet> dataset;
+            std::vector<int> sliceShape;
+            Array buffer;
+            int numBuffered;
+            int numRows;
+        };
+
+
         /**
         A class representing an HDF5 file.
         */
@@ -348,7 +791,26 @@ namespace Cow
             Create or open an HDF5 file. Mode may be "r", "a", or "w"
             corresponding to read, read/write, and truncate modes.
             */
-            File (std::string name, const char* mode="r");
+            File (std::string name, const char* mode="r",
+                PropertyList::FileAccess properties=PropertyList::FileAccess());
+
+            /**
+            Create or open an HDF5 file shared by all processes of the given
+            communicator, through the MPI-IO driver (H5Pset_fapl_mpio). This
+            is a collective operation, as are all later operations that
+            change the file's metadata (creating groups and data sets, for
+            example). Throws if the HDF5 library was built without parallel
+            support. Other access properties may be given, which are copied
+            before the MPI-IO driver is set.
+            */
+            File (std::string name, const char* mode, const MpiCommunicator& communicator,
+                PropertyList::FileAccess properties=PropertyList::FileAccess());
+
+            /**
+            Return true if the HDF5 library was built with parallel support,
+            so that files may be opened with an MpiCommunicator.
+            */
+            static bool isParallelSupported();
 
             /**
             Return the number of HDF5 objects that are open and attached to
@@ -357,6 +819,7 @@ namespace Cow
             int getObjectCount() const;
 
         private:
+            void open (std::string name, const char* mode, long long accessProperties);
             const Object* getObject() const override { return object.get(); }
             std::shared_ptr<Object> object;
         };
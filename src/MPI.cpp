@@ -1,5 +1,13 @@
 #include <iostream> // DEBUG
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <mpi.h>
 #include "MPI.hpp"
 
@@ -8,6 +16,85 @@ using namespace Cow;
 
 
 
+/**
+The start of each process's segment of a shared memory window (see
+MpiCommunicator::allocateShared). The shape of the array is written when it
+is allocated, and the region being sent is written on every exchange, so
+that neighbors know where to load from.
+*/
+struct SharedSegmentHeader
+{
+    int shape[5];
+    int lower[5];
+    int upper[5];
+    int stride[5];
+};
+static const std::size_t sharedHeaderSize = 128;
+
+/**
+The number of windows created by allocateShared and allocateWindow and not
+yet freed. They must all be freed before MPI_Finalize.
+*/
+static std::atomic<int> numLiveWindows (0);
+
+
+/**
+Copy a region of one array into a region of the same shape in another
+array, where the regions are absolute and may be strided.
+*/
+static void copyRegion (const double* source, Shape sourceShape, Region sourceRegion,
+    double* target, Shape targetShape, Region targetRegion)
+{
+    auto strides = [] (Shape shape)
+    {
+        auto S = Shape();
+        S[4] = 1;
+
+        for (int n = 3; n >= 0; --n)
+        {
+            S[n] = S[n + 1] * shape[n + 1];
+        }
+        return S;
+    };
+
+    const auto S = strides (sourceShape);
+    const auto T = strides (targetShape);
+    const auto N = sourceRegion.shape();
+    const int s4 = sourceRegion.stride[4];
+    const int t4 = targetRegion.stride[4];
+
+    for (int i = 0; i < N[0]; ++i)
+    for (int j = 0; j < N[1]; ++j)
+    for (int k = 0; k < N[2]; ++k)
+    for (int m = 0; m < N[3]; ++m)
+    {
+        const int index[4] = {i, j, k, m};
+        std::size_t a = sourceRegion.lower[4];
+        std::size_t b = targetRegion.lower[4];
+
+        for (int n = 0; n < 4; ++n)
+        {
+            a += std::size_t (sourceRegion.lower[n] + index[n] * sourceRegion.stride[n]) * S[n];
+            b += std::size_t (targetRegion.lower[n] + index[n] * targetRegion.stride[n]) * T[n];
+        }
+
+        if (s4 == 1 && t4 == 1)
+        {
+            std::memcpy (target + b, source + a, N[4] * sizeof (double));
+        }
+        else
+        {
+            for (int q = 0; q < N[4]; ++q)
+            {
+                target[b + q * t4] = source[a + q * s4];
+            }
+        }
+    }
+}
+
+
+
+
 // ============================================================================
 struct MpiCommunicator::Internals
 {
@@ -26,12 +113,194 @@ public:
 
     ~Internals()
     {
+        if (reductionWindow.window != MPI_WIN_NULL)
+        {
+            MPI_Win_unlock_all (reductionWindow.window);
+            MPI_Win_free (&reductionWindow.window);
+        }
+        if (sparseComm != MPI_COMM_NULL)
+        {
+            MPI_Comm_free (&sparseComm);
+        }
         MPI_Comm_free (&comm);
     }
 
+    /**
+    Return a pointer to the given buffer, after growing it if necessary to
+    hold at least count doubles. Buffers are never shrunk, so that repeated
+    exchanges of the same regions do not allocate.
+    */
+    double* getBuffer (HeapAllocation& buffer, std::size_t count)
+    {
+        if (buffer.size() < count * sizeof (double))
+        {
+            buffer = HeapAllocation (count * sizeof (double));
+        }
+        return buffer.begin<double>();
+    }
+
+    /**
+    An MPI shared memory window holding one array per process of the node.
+    Each process's segment starts with a SharedSegmentHeader, followed by
+    the array data.
+    */
+    struct SharedWindow
+    {
+        MPI_Win window;
+        std::vector<char*> segments;
+    };
+
+    /**
+    Free the shared memory window whose array data begins at the given
+    address. This is collective over the node.
+    */
+    void freeSharedWindow (void* memory)
+    {
+        auto entry = sharedWindows.find (memory);
+        assert (entry != sharedWindows.end());
+        MPI_Win_unlock_all (entry->second.window);
+        MPI_Win_free (&entry->second.window);
+        sharedWindows.erase (entry);
+        --numLiveWindows;
+    }
+
+    /**
+    Free the RMA window whose memory begins at the given address. This is
+    collective over the communicator.
+    */
+    void freeExposedWindow (void* memory)
+    {
+        auto entry = exposedWindows.find (memory);
+        assert (entry != exposedWindows.end());
+        MPI_Win_free (&entry->second);
+        exposedWindows.erase (entry);
+        --numLiveWindows;
+    }
+
+    /**
+    The data types describing where one process's send region lands in its
+    neighbor's window.
+    */
+    struct RmaTransfer
+    {
+        MpiDataType origin;
+        MpiDataType target;
+    };
+
+    /**
+    The shared memory window used by allreduceHierarchical. Each process's
+    segment holds capacity doubles of input, and the leader's segment is
+    followed by capacity doubles for the result, so that the leader does not
+    overwrite its input while others may still be loading the last result.
+    */
+    struct ReductionWindow
+    {
+        MPI_Win window = MPI_WIN_NULL;
+        std::vector<double*> segments;
+        int capacity = 0;
+    };
+
     MPI_Comm comm;
+    std::shared_ptr<Internals> node;
+    std::shared_ptr<Internals> leaders;
+    bool leadersCreated = false;
+    std::vector<int> nodeRanks;
+    std::map<const void*, SharedWindow> sharedWindows;
+    std::map<const void*, MPI_Win> exposedWindows;
+    std::map<std::vector<int>, RmaTransfer> rmaTransfers;
+    ReductionWindow reductionWindow;
+    MPI_Comm sparseComm = MPI_COMM_NULL;
+    int sparseRound = 0;
+    bool hierarchicalReductions = false;
+    MpiCartComm::ExchangeMode exchangeMode = MpiCartComm::ExchangeMode::datatype;
+    int numPackingThreads = 1;
+    std::map<std::vector<int>, bool> packingIsFaster;
+    HeapAllocation sendBuffer;
+    HeapAllocation recvBuffer;
+};
+
+
+
+
+// ============================================================================
+/**
+The requests registered for progress, and the thread which drives them.
+Handles of registered requests are only read or written while holding the
+mutex, since the thread may complete them at any time. Only the request's
+owner registers and unregisters it.
+*/
+struct ProgressEngine
+{
+    ~ProgressEngine()
+    {
+        stop();
+    }
+
+    int poll()
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+
+        if (requests.empty())
+        {
+            return 0;
+        }
+
+        handles.resize (requests.size());
+        indices.resize (requests.size());
+
+        for (unsigned int n = 0; n < requests.size(); ++n)
+        {
+            handles[n] = *requests[n];
+        }
+
+        int numCompleted;
+        MPI_Testsome (handles.size(), &handles[0], &numCompleted, &indices[0], MPI_STATUSES_IGNORE);
+
+        for (unsigned int n = 0; n < requests.size(); ++n)
+        {
+            *requests[n] = handles[n];
+        }
+        return numCompleted == MPI_UNDEFINED ? 0 : numCompleted;
+    }
+
+    void start (int intervalMicroseconds)
+    {
+        stop();
+        running = true;
+        thread = std::thread ([this, intervalMicroseconds] ()
+        {
+            while (running)
+            {
+                poll();
+                std::this_thread::sleep_for (std::chrono::microseconds (intervalMicroseconds));
+            }
+        });
+    }
+
+    void stop()
+    {
+        running = false;
+
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+
+    std::mutex mutex;
+    std::vector<MPI_Request*> requests;
+    std::vector<MPI_Request> handles;
+    std::vector<int> indices;
+    std::atomic<bool> running {false};
+    std::thread thread;
 };
 
+static ProgressEngine& getProgressEngine()
+{
+    static ProgressEngine engine;
+    return engine;
+}
+
 
 
 
@@ -46,10 +315,41 @@ public:
 
     ~Internals()
     {
-        MPI_Request_free (&request);
+        unregister();
+
+        if (request != MPI_REQUEST_NULL)
+        {
+            MPI_Request_free (&request);
+        }
+    }
+
+    void unregister()
+    {
+        if (registered)
+        {
+            auto& engine = getProgressEngine();
+            std::lock_guard<std::mutex> lock (engine.mutex);
+            auto& requests = engine.requests;
+            requests.erase (std::remove (requests.begin(), requests.end(), &request), requests.end());
+            registered = false;
+        }
+    }
+
+    /**
+    Return a lock on the progress engine if this request is registered with
+    it, or an empty lock otherwise.
+    */
+    std::unique_lock<std::mutex> lockIfRegistered()
+    {
+        if (registered)
+        {
+            return std::unique_lock<std::mutex> (getProgressEngine().mutex);
+        }
+        return std::unique_lock<std::mutex>();
     }
 
     MPI_Request request;
+    bool registered = false;
 };
 
 
@@ -82,15 +382,129 @@ public:
 
 
 
+// ============================================================================
+struct MpiReductionBatch::Internals
+{
+public:
+    Internals()
+    {
+        MPI_Type_contiguous (2, MPI_DOUBLE, &entryType);
+        MPI_Type_commit (&entryType);
+        MPI_Op_create (reduceTaggedEntries, true, &operation);
+    }
+
+    ~Internals()
+    {
+        MPI_Type_free (&entryType);
+        MPI_Op_free (&operation);
+    }
+
+    /**
+    Each entry is a pair of doubles: a tag holding the integer value of the
+    reduction to apply, and the value itself. Because the entry is the unit
+    of the data type, MPI never splits a tag from its value, even when it
+    segments a large reduction.
+    */
+    static void reduceTaggedEntries (void* in, void* inout, int* length, MPI_Datatype*)
+    {
+        auto a = static_cast<const double*> (in);
+        auto b = static_cast<double*> (inout);
+
+        for (int n = 0; n < *length; ++n)
+        {
+            const double x = a[2 * n + 1];
+            double& y = b[2 * n + 1];
+
+            switch (MpiCommunicator::Reduction (int (b[2 * n])))
+            {
+                case MpiCommunicator::Reduction::minimum: y = std::min (x, y); break;
+                case MpiCommunicator::Reduction::maximum: y = std::max (x, y); break;
+                case MpiCommunicator::Reduction::sum: y += x; break;
+            }
+        }
+    }
+
+    MPI_Datatype entryType;
+    MPI_Op operation;
+    std::vector<double> entries;
+};
+
+
+
+
+// ============================================================================
+struct MpiRedistributionPlan::Internals
+{
+public:
+    /**
+    The regions and offsets describing one chunk of the exchange. Offsets
+    and counts are in units of doubles.
+    */
+    struct Chunk
+    {
+        std::vector<Region> sendRegions;
+        std::vector<Region> recvRegions;
+        std::vector<int> sendCounts;
+        std::vector<int> sendOffsets;
+        std::vector<int> recvCounts;
+        std::vector<int> recvOffsets;
+        int sendTotal = 0;
+        int recvTotal = 0;
+    };
+
+    double* getBuffer (HeapAllocation& buffer, std::size_t count)
+    {
+        if (buffer.size() < count * sizeof (double))
+        {
+            buffer = HeapAllocation (count * sizeof (double));
+        }
+        return buffer.begin<double>();
+    }
+
+    MpiCommunicator communicator;
+    Shape sourceShape;
+    Shape targetShape;
+    Method method;
+    std::vector<Chunk> chunks;
+    std::vector<MpiDataType> sendTypes;
+    std::vector<MpiDataType> recvTypes;
+    HeapAllocation sendBuffers[2];
+    HeapAllocation recvBuffers[2];
+};
+
+
+
+
+// ============================================================================
+static MPI_Op getMpiOperation (MpiCommunicator::Reduction operation)
+{
+    switch (operation)
+    {
+        case MpiCommunicator::Reduction::minimum: return MPI_MIN;
+        case MpiCommunicator::Reduction::maximum: return MPI_MAX;
+        case MpiCommunicator::Reduction::sum: return MPI_SUM;
+    }
+    assert (false);
+    return MPI_OP_NULL;
+}
+
+
+
+
 // ============================================================================
 MpiRequest::MpiRequest (Internals* internals) : internals (internals)
 {
 
 }
 
+MpiRequest::MpiRequest (MpiRequest&& other) : internals (std::move (other.internals))
+{
+
+}
+
 MpiRequest::~MpiRequest()
 {
-    if (! test())
+    if (internals && ! test())
     {
         std::cerr
         << "Warning: an MPI request is going out of scope "
@@ -103,14 +517,18 @@ void MpiRequest::cancel()
 {
     // Note this function takes a pointer to the request handle, as it intends
     // to modify its value if the request is fulfilled.
+    auto lock = internals->lockIfRegistered();
     MPI_Cancel (&internals->request);
 }
 
 void MpiRequest::wait()
 {
     // Note this function takes a pointer to the request handle, as it intends
-    // to modify its value if the request is fulfilled.
+    // to modify its value if the request is fulfilled. The request is taken
+    // back from the progress engine first, so that the engine is not held up
+    // while this thread waits.
     MPI_Status status;
+    internals->unregister();
     MPI_Wait (&internals->request, &status);
 }
 
@@ -120,7 +538,14 @@ bool MpiRequest::test()
     // to modify its value if the request is fulfilled.
     int result;
     MPI_Status status;
-    MPI_Test (&internals->request, &result, &status);
+    {
+        auto lock = internals->lockIfRegistered();
+        MPI_Test (&internals->request, &result, &status);
+    }
+    if (result)
+    {
+        internals->unregister();
+    }
     return result;
 }
 
@@ -130,10 +555,22 @@ bool MpiRequest::getStatus() const
     // it does not modify its value even if the request is fulfilled.
     int result;
     MPI_Status status;
+    auto lock = internals->lockIfRegistered();
     MPI_Request_get_status (internals->request, &result, &status);
     return result;
 }
 
+void MpiRequest::enableProgress()
+{
+    if (! internals->registered)
+    {
+        auto& engine = getProgressEngine();
+        std::lock_guard<std::mutex> lock (engine.mutex);
+        engine.requests.push_back (&internals->request);
+        internals->registered = true;
+    }
+}
+
 
 
 // ============================================================================
@@ -170,16 +607,260 @@ int MpiCommunicator::size() const
     return S;
 }
 
+MPI_Comm MpiCommunicator::getMpiComm() const
+{
+    return internals->comm;
+}
+
 void MpiCommunicator::inSequence (std::function<void (int)> callback) const
 {
-    for (int n = 0; n < size(); ++n)
+    // A token is passed from each rank to the next, which costs one message
+    // latency per rank, rather than one barrier per rank.
+    const int tag = 12347;
+    char token = 0;
+
+    if (rank() > 0)
+    {
+        MPI_Recv (&token, 1, MPI_CHAR, rank() - 1, tag, internals->comm, MPI_STATUS_IGNORE);
+    }
+
+    callback (rank());
+
+    if (rank() < size() - 1)
+    {
+        MPI_Send (&token, 1, MPI_CHAR, rank() + 1, tag, internals->comm);
+    }
+    MPI_Barrier (internals->comm);
+}
+
+void MpiCommunicator::inSequence (std::ostream& stream, std::function<void (int, std::ostream&)> callback) const
+{
+    auto output = std::ostringstream();
+    callback (rank(), output);
+
+    for (const auto& payload : gatherInOrder (HeapAllocation (output.str())))
+    {
+        stream << payload;
+    }
+    stream.flush();
+}
+
+std::vector<HeapAllocation> MpiCommunicator::gatherInOrder (const HeapAllocation& payload) const
+{
+    // Each process contributes a pair of ints (rank, size) describing its
+    // payload, followed by the payload bytes. The descriptions and bytes are
+    // concatenated on each node leader, and then on the master, which uses
+    // the descriptions to cut the bytes apart and put them in rank order.
+    auto gatherv = [] (const std::vector<char>& send, MPI_Comm comm, int commSize)
+    {
+        int sendCount = send.size();
+        int thisRank;
+        MPI_Comm_rank (comm, &thisRank);
+
+        auto counts = std::vector<int> (thisRank == 0 ? commSize : 0);
+        auto offsets = std::vector<int> (counts.size());
+        MPI_Gather (&sendCount, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+
+        for (unsigned int n = 1; n < counts.size(); ++n)
+        {
+            offsets[n] = offsets[n - 1] + counts[n - 1];
+        }
+
+        auto recv = std::vector<char> (counts.empty() ? 0 : offsets.back() + counts.back());
+        MPI_Gatherv (send.data(), sendCount, MPI_CHAR,
+            recv.data(), counts.data(), offsets.data(), MPI_CHAR, 0, comm);
+        return recv;
+    };
+
+    auto pack = [] (const std::vector<int>& descriptions, const std::vector<char>& bytes)
+    {
+        int numInts = descriptions.size();
+        auto buffer = std::vector<char> (sizeof (int) * (1 + numInts) + bytes.size());
+        std::memcpy (&buffer[0], &numInts, sizeof (int));
+        std::memcpy (&buffer[sizeof (int)], descriptions.data(), sizeof (int) * numInts);
+        std::copy (bytes.begin(), bytes.end(), buffer.begin() + sizeof (int) * (1 + numInts));
+        return buffer;
+    };
+
+    auto node = splitByNode();
+    auto leaders = splitByNodeLeaders();
+    auto bytes = static_cast<const char*> (payload.begin());
+    auto mine = pack ({rank(), int (payload.size())}, std::vector<char> (bytes, bytes + payload.size()));
+    auto nodeBlocks = gatherv (mine, node.internals->comm, node.size());
+
+    if (! leaders.isValid())
+    {
+        return {};
+    }
+
+    // Merge the node's blocks into a single block.
+    auto descriptions = std::vector<int>();
+    auto nodeBytes = std::vector<char>();
+
+    for (std::size_t offset = 0; offset < nodeBlocks.size();)
+    {
+        int numInts;
+        std::memcpy (&numInts, &nodeBlocks[offset], sizeof (int));
+        auto ints = std::vector<int> (numInts);
+        std::memcpy (ints.data(), &nodeBlocks[offset + sizeof (int)], sizeof (int) * numInts);
+        offset += sizeof (int) * (1 + numInts);
+
+        for (int n = 0; n < numInts; n += 2)
+        {
+            descriptions.insert (descriptions.end(), {ints[n], ints[n + 1]});
+            nodeBytes.insert (nodeBytes.end(), nodeBlocks.data() + offset, nodeBlocks.data() + offset + ints[n + 1]);
+            offset += ints[n + 1];
+        }
+    }
+
+    auto allBlocks = gatherv (pack (descriptions, nodeBytes), leaders.internals->comm, leaders.size());
+
+    if (! isThisMaster())
+    {
+        return {};
+    }
+
+    auto payloads = std::vector<HeapAllocation> (size());
+
+    for (std::size_t offset = 0; offset < allBlocks.size();)
+    {
+        int numInts;
+        std::memcpy (&numInts, &allBlocks[offset], sizeof (int));
+        auto ints = std::vector<int> (numInts);
+        std::memcpy (ints.data(), &allBlocks[offset + sizeof (int)], sizeof (int) * numInts);
+        offset += sizeof (int) * (1 + numInts);
+
+        for (int n = 0; n < numInts; n += 2)
+        {
+            payloads[ints[n]] = HeapAllocation (ints[n + 1]);
+            std::memcpy (payloads[ints[n]].begin(), allBlocks.data() + offset, ints[n + 1]);
+            offset += ints[n + 1];
+        }
+    }
+    return payloads;
+}
+
+std::map<int, HeapAllocation> MpiCommunicator::exchangeSparse (
+    const std::map<int, HeapAllocation>& outgoing,
+    SparseExchange method) const
+{
+    auto incoming = std::map<int, HeapAllocation>();
+
+    if (method == SparseExchange::alltoallv)
+    {
+        const int P = size();
+        auto sendCounts = std::vector<int> (P);
+        auto recvCounts = std::vector<int> (P);
+        auto sendOffsets = std::vector<int> (P);
+        auto recvOffsets = std::vector<int> (P);
+
+        // A count of -1 means no payload, so that empty payloads may still be
+        // told apart from none at all.
+        auto sendSizes = std::vector<int> (P, -1);
+        auto recvSizes = std::vector<int> (P);
+
+        for (const auto& entry : outgoing)
+        {
+            sendSizes[entry.first] = entry.second.size();
+        }
+        MPI_Alltoall (sendSizes.data(), 1, MPI_INT, recvSizes.data(), 1, MPI_INT, internals->comm);
+
+        for (int n = 0; n < P; ++n)
+        {
+            sendCounts[n] = std::max (sendSizes[n], 0);
+            recvCounts[n] = std::max (recvSizes[n], 0);
+        }
+        for (int n = 1; n < P; ++n)
+        {
+            sendOffsets[n] = sendOffsets[n - 1] + sendCounts[n - 1];
+            recvOffsets[n] = recvOffsets[n - 1] + recvCounts[n - 1];
+        }
+
+        auto send = std::vector<char> (sendOffsets.back() + sendCounts.back());
+        auto recv = std::vector<char> (recvOffsets.back() + recvCounts.back());
+
+        for (const auto& entry : outgoing)
+        {
+            auto bytes = static_cast<const char*> (entry.second.begin());
+            std::copy (bytes, bytes + entry.second.size(), send.begin() + sendOffsets[entry.first]);
+        }
+
+        MPI_Alltoallv (
+            send.data(), sendCounts.data(), sendOffsets.data(), MPI_CHAR,
+            recv.data(), recvCounts.data(), recvOffsets.data(), MPI_CHAR, internals->comm);
+
+        for (int n = 0; n < P; ++n)
+        {
+            if (recvSizes[n] >= 0)
+            {
+                auto payload = HeapAllocation (recvCounts[n]);
+                std::memcpy (payload.begin(), recv.data() + recvOffsets[n], recvCounts[n]);
+                incoming[n] = std::move (payload);
+            }
+        }
+        return incoming;
+    }
+
+    // A synchronous send completes only once it has been matched by a
+    // receive, so when all of a process's sends are complete, its messages
+    // have all been delivered. It then enters the barrier, and keeps
+    // receiving until every process has entered it.
+    //
+    // A process may leave the barrier and send the next round's messages
+    // while another is still probing for this round's. The messages go over
+    // a communicator of their own, tagged by the parity of the round: the
+    // round after next cannot begin until every process has entered the
+    // next round's barrier, and so left this round.
+    if (internals->sparseComm == MPI_COMM_NULL)
     {
-        if (rank() == n)
+        MPI_Comm_dup (internals->comm, &internals->sparseComm);
+    }
+    auto comm = internals->sparseComm;
+    auto tag = internals->sparseRound++ % 2;
+    auto sends = std::vector<MPI_Request> (outgoing.size());
+    auto barrier = MPI_REQUEST_NULL;
+    auto barrierEntered = false;
+    auto done = 0;
+    auto n = 0;
+
+    for (const auto& entry : outgoing)
+    {
+        MPI_Issend (entry.second.begin(), entry.second.size(), MPI_CHAR,
+            entry.first, tag, comm, &sends[n++]);
+    }
+
+    while (! done)
+    {
+        int flag;
+        MPI_Status status;
+        MPI_Iprobe (MPI_ANY_SOURCE, tag, comm, &flag, &status);
+
+        if (flag)
+        {
+            int count;
+            MPI_Get_count (&status, MPI_CHAR, &count);
+            auto payload = HeapAllocation (count);
+            MPI_Recv (payload.begin(), count, MPI_CHAR, status.MPI_SOURCE, tag, comm, MPI_STATUS_IGNORE);
+            incoming[status.MPI_SOURCE] = std::move (payload);
+        }
+
+        if (barrierEntered)
+        {
+            MPI_Test (&barrier, &done, MPI_STATUS_IGNORE);
+        }
+        else
         {
-            callback (n);
+            int sent;
+            MPI_Testall (sends.size(), sends.data(), &sent, MPI_STATUSES_IGNORE);
+
+            if (sent)
+            {
+                MPI_Ibarrier (comm, &barrier);
+                barrierEntered = true;
+            }
         }
-        MPI_Barrier (internals->comm);
     }
+    return incoming;
 }
 
 void MpiCommunicator::onMasterOnly (std::function<void()> callback) const
@@ -191,7 +872,66 @@ void MpiCommunicator::onMasterOnly (std::function<void()> callback) const
     MPI_Barrier (internals->comm);
 }
 
-MpiCartComm MpiCommunicator::createCartesian (int ndims, std::vector<bool> axisIsDistributed) const
+/**
+Choose the number of processes on each axis of the grid of processes held by
+one node, so that the node grid times the on-node grid gives dims. Each node
+block shares a face with the neighboring nodes on every axis where there is
+more than one node; the chosen factors minimize the total area of those
+faces, measured in process faces. Returns an empty vector if nodeSize can
+not be factored that way.
+*/
+static std::vector<int> factorNodeGrid (const std::vector<int>& dims, int nodeSize)
+{
+    const int ndims = dims.size();
+    auto best = std::vector<int>();
+    auto onNode = std::vector<int> (ndims, 1);
+    long bestCost = -1;
+
+    std::function<void (int, int)> search = [&] (int axis, int remaining)
+    {
+        if (axis == ndims)
+        {
+            if (remaining != 1)
+            {
+                return;
+            }
+            long cost = 0;
+
+            for (int a = 0; a < ndims; ++a)
+            {
+                if (dims[a] / onNode[a] > 1)
+                {
+                    long face = 1;
+
+                    for (int b = 0; b < ndims; ++b)
+                    {
+                        if (b != a) face *= onNode[b];
+                    }
+                    cost += face;
+                }
+            }
+            if (bestCost == -1 || cost < bestCost)
+            {
+                bestCost = cost;
+                best = onNode;
+            }
+            return;
+        }
+
+        for (int q = 1; q <= dims[axis]; ++q)
+        {
+            if (dims[axis] % q == 0 && remaining % q == 0)
+            {
+                onNode[axis] = q;
+                search (axis + 1, remaining / q);
+            }
+        }
+    };
+    search (0, nodeSize);
+    return best;
+}
+
+MpiCartComm MpiCommunicator::createCartesian (int ndims, std::vector<bool> axisIsDistributed, bool nodeAware) const
 {
     std::vector<int> dims (ndims, 0);
     std::vector<int> periods (ndims, 1);
@@ -212,6 +952,51 @@ MpiCartComm MpiCommunicator::createCartesian (int ndims, std::vector<bool> axisI
 
     MPI_Comm cart;
     MPI_Dims_create (size(), ndims, &dims[0]);
+
+    if (nodeAware)
+    {
+        auto node = splitByNode();
+        auto leaders = splitByNodeLeaders();
+        auto onNode = std::vector<int>();
+
+        if (minimum (node.size()) == maximum (node.size()))
+        {
+            onNode = factorNodeGrid (dims, node.size());
+        }
+
+        if (! onNode.empty())
+        {
+            // Number the nodes by the rank of their leaders, then place this
+            // process at its node's block of the grid, offset by its rank on
+            // the node. Cartesian ranks are in row-major order of the
+            // coordinates, so splitting with the resulting rank as the key
+            // and creating the topology without reordering puts it there.
+            int nodeIndex = leaders.isValid() ? leaders.rank() : 0;
+            MPI_Bcast (&nodeIndex, 1, MPI_INT, 0, node.internals->comm);
+
+            int nodeRemainder = nodeIndex;
+            int localRemainder = node.rank();
+            int placedRank = 0;
+            int stride = 1;
+
+            for (int a = ndims - 1; a >= 0; --a)
+            {
+                const int numNodes = dims[a] / onNode[a];
+                const int coordinate = (nodeRemainder % numNodes) * onNode[a] + localRemainder % onNode[a];
+                nodeRemainder /= numNodes;
+                localRemainder /= onNode[a];
+                placedRank += coordinate * stride;
+                stride *= dims[a];
+            }
+
+            MPI_Comm ordered;
+            MPI_Comm_split (internals->comm, 0, placedRank, &ordered);
+            MPI_Cart_create (ordered, ndims, &dims[0], &periods[0], 0, &cart);
+            MPI_Comm_free (&ordered);
+            return new Internals (cart, true);
+        }
+    }
+
     MPI_Cart_create (internals->comm, ndims, &dims[0], &periods[0], reorder, &cart);
     return new Internals (cart, true);
 }
@@ -224,8 +1009,199 @@ MpiCommunicator MpiCommunicator::split (int color) const
     return new Internals (comm, true);
 }
 
+MpiCommunicator MpiCommunicator::duplicate() const
+{
+    return duplicateInternals();
+}
+
+std::vector<MpiCommunicator> MpiCommunicator::duplicateForThreads (int numThreads) const
+{
+    auto duplicates = std::vector<MpiCommunicator>();
+
+    for (int n = 0; n < numThreads; ++n)
+    {
+        duplicates.push_back (duplicate());
+    }
+    return duplicates;
+}
+
+MpiCommunicator::Internals* MpiCommunicator::duplicateInternals() const
+{
+    auto duplicate = new Internals (internals->comm);
+    duplicate->exchangeMode = internals->exchangeMode;
+    duplicate->numPackingThreads = internals->numPackingThreads;
+    duplicate->hierarchicalReductions = internals->hierarchicalReductions;
+    return duplicate;
+}
+
+std::vector<int> MpiCommunicator::translateRanks (const MpiCommunicator& other) const
+{
+    MPI_Group thisGroup;
+    MPI_Group otherGroup;
+    MPI_Comm_group (internals->comm, &thisGroup);
+    MPI_Comm_group (other.internals->comm, &otherGroup);
+
+    auto ranks = std::vector<int> (size());
+    auto translated = std::vector<int> (size());
+
+    for (int n = 0; n < size(); ++n)
+    {
+        ranks[n] = n;
+    }
+    MPI_Group_translate_ranks (thisGroup, size(), &ranks[0], otherGroup, &translated[0]);
+    MPI_Group_free (&thisGroup);
+    MPI_Group_free (&otherGroup);
+
+    for (auto& rank : translated)
+    {
+        if (rank == MPI_UNDEFINED) rank = -1;
+    }
+    return translated;
+}
+
+MpiCommunicator MpiCommunicator::splitByNode() const
+{
+    if (! internals->node)
+    {
+        MPI_Comm comm;
+        MPI_Comm_split_type (internals->comm, MPI_COMM_TYPE_SHARED, rank(), MPI_INFO_NULL, &comm);
+        internals->node = std::make_shared<Internals> (comm, true);
+    }
+
+    auto node = MpiCommunicator();
+    node.internals = internals->node;
+
+    if (internals->nodeRanks.empty())
+    {
+        internals->nodeRanks = translateRanks (node);
+    }
+    return node;
+}
+
+MpiCommunicator MpiCommunicator::splitByNodeLeaders() const
+{
+    if (! internals->leadersCreated)
+    {
+        MPI_Comm comm;
+        int color = splitByNode().rank() == 0 ? 0 : MPI_UNDEFINED;
+        MPI_Comm_split (internals->comm, color, rank(), &comm);
+
+        if (comm != MPI_COMM_NULL)
+        {
+            internals->leaders = std::make_shared<Internals> (comm, true);
+        }
+        internals->leadersCreated = true;
+    }
+
+    auto leaders = MpiCommunicator();
+    leaders.internals = internals->leaders;
+    return leaders;
+}
+
+Array MpiCommunicator::allocateShared (Shape shape) const
+{
+    auto node = splitByNode();
+    auto numBytes = sizeof (double);
+
+    for (int n = 0; n < 5; ++n)
+    {
+        numBytes *= shape[n];
+    }
+
+    // Ask for each process's segment to be allocated separately, so that it
+    // is placed in memory near the process that first touches it.
+    MPI_Info info;
+    MPI_Info_create (&info);
+    MPI_Info_set (info, "alloc_shared_noncontig", "true");
+
+    char* base;
+    auto shared = Internals::SharedWindow();
+    MPI_Win_allocate_shared (sharedHeaderSize + numBytes, 1, info, node.internals->comm, &base, &shared.window);
+    MPI_Info_free (&info);
+
+    // A single passive target epoch lasts for the life of the window, and
+    // exchanges synchronize with MPI_Win_sync and barriers over the node.
+    MPI_Win_lock_all (MPI_MODE_NOCHECK, shared.window);
+
+    for (int n = 0; n < node.size(); ++n)
+    {
+        MPI_Aint segmentSize;
+        int displacementUnit;
+        char* segment;
+        MPI_Win_shared_query (shared.window, n, &segmentSize, &displacementUnit, &segment);
+        shared.segments.push_back (segment);
+    }
+
+    auto header = reinterpret_cast<SharedSegmentHeader*> (base);
+    std::memset (base, 0, sharedHeaderSize + numBytes);
+    std::copy (shape.begin(), shape.end(), header->shape);
+
+    char* data = base + sharedHeaderSize;
+    auto owner = internals;
+    internals->sharedWindows[data] = shared;
+    ++numLiveWindows;
+
+    auto A = Array (shape);
+    A.getAllocation() = HeapAllocation (data, numBytes, [owner] (void* memory)
+    {
+        owner->freeSharedWindow (memory);
+    });
+    return A;
+}
+
+bool MpiCommunicator::isSharedAllocation (const Array& A) const
+{
+    return internals->sharedWindows.count (A.getAllocation().begin()) != 0;
+}
+
+Array MpiCommunicator::allocateWindow (Shape shape) const
+{
+    auto numBytes = sizeof (double);
+
+    for (int n = 0; n < 5; ++n)
+    {
+        numBytes *= shape[n];
+    }
+
+    // Windows used only with fences or post-start-complete-wait never need
+    // the lock machinery. At least one double is allocated so that empty
+    // arrays still have distinct addresses.
+    MPI_Info info;
+    MPI_Info_create (&info);
+    MPI_Info_set (info, "no_locks", "true");
+
+    void* data;
+    MPI_Win window;
+    MPI_Win_allocate (std::max (numBytes, sizeof (double)), sizeof (double), info, internals->comm, &data, &window);
+    MPI_Info_free (&info);
+
+    std::memset (data, 0, numBytes);
+    auto owner = internals;
+    internals->exposedWindows[data] = window;
+    ++numLiveWindows;
+
+    auto A = Array (shape);
+    A.getAllocation() = HeapAllocation (data, numBytes, [owner] (void* memory)
+    {
+        owner->freeExposedWindow (memory);
+    });
+    return A;
+}
+
+bool MpiCommunicator::isWindowAllocation (const Array& A) const
+{
+    return internals->exposedWindows.count (A.getAllocation().begin()) != 0;
+}
+
 double MpiCommunicator::minimum (double x) const
 {
+    if (internals->hierarchicalReductions)
+    {
+        auto A = Array (1);
+        A[0] = x;
+        allreduceHierarchical (A, Reduction::minimum);
+        return A[0];
+    }
     double result;
     MPI_Allreduce (&x, &result, 1, MPI_DOUBLE, MPI_MIN, internals->comm);
     return result;
@@ -233,6 +1209,13 @@ double MpiCommunicator::minimum (double x) const
 
 double MpiCommunicator::maximum (double x) const
 {
+    if (internals->hierarchicalReductions)
+    {
+        auto A = Array (1);
+        A[0] = x;
+        allreduceHierarchical (A, Reduction::maximum);
+        return A[0];
+    }
     double result;
     MPI_Allreduce (&x, &result, 1, MPI_DOUBLE, MPI_MAX, internals->comm);
     return result;
@@ -240,11 +1223,416 @@ double MpiCommunicator::maximum (double x) const
 
 std::vector<double> MpiCommunicator::sum (const std::vector<double>& A) const
 {
+    if (internals->hierarchicalReductions)
+    {
+        auto B = Array (A.size());
+        std::copy (A.begin(), A.end(), B.begin());
+        allreduceHierarchical (B, Reduction::sum);
+        return std::vector<double> (B.begin(), B.end());
+    }
     auto ret = A;
     MPI_Allreduce (&A[0], &ret[0], ret.size(), MPI_DOUBLE, MPI_SUM, internals->comm);
     return ret;
 }
 
+long MpiCommunicator::sum (long x) const
+{
+    long ret;
+    MPI_Allreduce (&x, &ret, 1, MPI_LONG, MPI_SUM, internals->comm);
+    return ret;
+}
+
+void MpiCommunicator::allreduceHierarchical (Array& A, Reduction operation) const
+{
+    auto node = splitByNode();
+    auto leaders = splitByNodeLeaders();
+    auto& shared = internals->reductionWindow;
+    const int count = A.size();
+    const int nodeSize = node.size();
+    const bool isLeader = leaders.isValid();
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    // Every process of the node reduces arrays of the same size, so they
+    // all agree on when the window must grow.
+    if (count > shared.capacity)
+    {
+        if (shared.window != MPI_WIN_NULL)
+        {
+            MPI_Win_unlock_all (shared.window);
+            MPI_Win_free (&shared.window);
+        }
+
+        MPI_Info info;
+        MPI_Info_create (&info);
+        MPI_Info_set (info, "alloc_shared_noncontig", "true");
+
+        double* base;
+        auto numBytes = sizeof (double) * count * (isLeader ? 2 : 1);
+        MPI_Win_allocate_shared (numBytes, sizeof (double), info, node.internals->comm, &base, &shared.window);
+        MPI_Info_free (&info);
+        MPI_Win_lock_all (MPI_MODE_NOCHECK, shared.window);
+
+        shared.segments.clear();
+        shared.capacity = count;
+
+        for (int n = 0; n < nodeSize; ++n)
+        {
+            MPI_Aint segmentSize;
+            int displacementUnit;
+            double* segment;
+            MPI_Win_shared_query (shared.window, n, &segmentSize, &displacementUnit, &segment);
+            shared.segments.push_back (segment);
+        }
+    }
+
+    auto sync = [&] ()
+    {
+        MPI_Win_sync (shared.window);
+        MPI_Barrier (node.internals->comm);
+        MPI_Win_sync (shared.window);
+    };
+
+    std::copy (A.begin(), A.end(), shared.segments[node.rank()]);
+    sync();
+
+    if (isLeader)
+    {
+        // The inputs are combined in the order of rank on the node, so that
+        // sums do not depend on the timing of the other processes.
+        double* result = shared.segments[0] + shared.capacity;
+        std::copy (shared.segments[0], shared.segments[0] + count, result);
+
+        for (int n = 1; n < nodeSize; ++n)
+        {
+            const double* input = shared.segments[n];
+
+            for (int i = 0; i < count; ++i)
+            {
+                switch (operation)
+                {
+                    case Reduction::minimum: result[i] = std::min (result[i], input[i]); break;
+                    case Reduction::maximum: result[i] = std::max (result[i], input[i]); break;
+                    case Reduction::sum: result[i] += input[i]; break;
+                }
+            }
+        }
+        MPI_Allreduce (MPI_IN_PLACE, result, count, MPI_DOUBLE, getMpiOperation (operation), leaders.internals->comm);
+    }
+    sync();
+
+    const double* result = shared.segments[0] + shared.capacity;
+    std::copy (result, result + count, A.begin());
+}
+
+void MpiCommunicator::setHierarchicalReductions (bool shouldUseHierarchical)
+{
+    internals->hierarchicalReductions = shouldUseHierarchical;
+}
+
+void MpiCommunicator::allreduce (Array& A, Reduction operation) const
+{
+    MPI_Allreduce (MPI_IN_PLACE, A.begin(), A.size(), MPI_DOUBLE, getMpiOperation (operation), internals->comm);
+}
+
+MpiRequest MpiCommunicator::postAllreduce (Array& A, Reduction operation) const
+{
+    MPI_Request request;
+    MPI_Iallreduce (MPI_IN_PLACE, A.begin(), A.size(), MPI_DOUBLE, getMpiOperation (operation), internals->comm, &request);
+    return new MpiRequest::Internals (request);
+}
+
+void MpiCommunicator::send (const Array& A, Region R, int rank, int tag) const
+{
+    auto type = MpiDataType::subarray (A.shape(), R);
+    MPI_Send (A.getAllocation().begin(), 1, type.internals->type, rank, tag, internals->comm);
+}
+
+MpiRequest MpiCommunicator::post (const Array& A, Region R, int rank, int tag) const
+{
+    // It is safe for the data type to be freed before the request completes;
+    // MPI defers the deallocation until pending operations are done with it.
+    auto type = MpiDataType::subarray (A.shape(), R);
+    MPI_Request request;
+    MPI_Isend (A.getAllocation().begin(), 1, type.internals->type, rank, tag, internals->comm, &request);
+    return new MpiRequest::Internals (request);
+}
+
+void MpiCommunicator::receive (Array& A, Region R, int rank, int tag) const
+{
+    auto type = MpiDataType::subarray (A.shape(), R);
+    MPI_Status status;
+    MPI_Recv (A.begin(), 1, type.internals->type, rank, tag, internals->comm, &status);
+}
+
+MpiRequest MpiCommunicator::request (Array& A, Region R, int rank, int tag) const
+{
+    auto type = MpiDataType::subarray (A.shape(), R);
+    MPI_Request request;
+    MPI_Irecv (A.begin(), 1, type.internals->type, rank, tag, internals->comm, &request);
+    return new MpiRequest::Internals (request);
+}
+
+
+
+
+// ============================================================================
+MpiReductionBatch::MpiReductionBatch (MpiCommunicator communicator) :
+communicator (communicator),
+internals (new Internals)
+{
+
+}
+
+MpiReductionBatch::~MpiReductionBatch()
+{
+}
+
+int MpiReductionBatch::add (double x, MpiCommunicator::Reduction operation)
+{
+    int index = size();
+    internals->entries.push_back (double (operation));
+    internals->entries.push_back (x);
+    return index;
+}
+
+int MpiReductionBatch::add (const Array& A, MpiCommunicator::Reduction operation)
+{
+    int index = size();
+
+    for (int n = 0; n < A.size(); ++n)
+    {
+        add (A[n], operation);
+    }
+    return index;
+}
+
+int MpiReductionBatch::size() const
+{
+    return internals->entries.size() / 2;
+}
+
+void MpiReductionBatch::clear()
+{
+    internals->entries.clear();
+}
+
+void MpiReductionBatch::reduce()
+{
+    MPI_Allreduce (MPI_IN_PLACE,
+        internals->entries.data(),
+        size(),
+        internals->entryType,
+        internals->operation,
+        communicator.internals->comm);
+}
+
+MpiRequest MpiReductionBatch::post()
+{
+    MPI_Request request;
+    MPI_Iallreduce (MPI_IN_PLACE,
+        internals->entries.data(),
+        size(),
+        internals->entryType,
+        internals->operation,
+        communicator.internals->comm,
+        &request);
+    return new MpiRequest::Internals (request);
+}
+
+double MpiReductionBatch::getResult (int index) const
+{
+    return internals->entries[2 * index + 1];
+}
+
+void MpiReductionBatch::getResult (int index, Array& A) const
+{
+    for (int n = 0; n < A.size(); ++n)
+    {
+        A[n] = getResult (index + n);
+    }
+}
+
+
+
+
+// ============================================================================
+MpiRedistributionPlan::MpiRedistributionPlan()
+{
+
+}
+
+MpiRedistributionPlan::MpiRedistributionPlan (MpiCommunicator communicator,
+    Shape sourceShape, std::vector<Region> sendRegions,
+    Shape targetShape, std::vector<Region> recvRegions,
+    Method method, int numChunks) : internals (new Internals)
+{
+    const int P = communicator.size();
+    assert (int (sendRegions.size()) == P);
+    assert (int (recvRegions.size()) == P);
+
+    internals->communicator = communicator;
+    internals->sourceShape = sourceShape;
+    internals->targetShape = targetShape;
+    internals->method = method;
+
+    if (method != Method::pipelined)
+    {
+        numChunks = 1;
+    }
+
+    if (method == Method::alltoallw)
+    {
+        for (int rank = 0; rank < P; ++rank)
+        {
+            const auto& send = sendRegions[rank];
+            const auto& recv = recvRegions[rank];
+            internals->sendTypes.push_back (send.isEmpty() ? MpiDataType::nativeDouble() : MpiDataType::subarray (sourceShape, send));
+            internals->recvTypes.push_back (recv.isEmpty() ? MpiDataType::nativeDouble() : MpiDataType::subarray (targetShape, recv));
+        }
+    }
+
+    // A pair of ranks exchange regions of the same shape, so splitting each
+    // region into chunks along its longest axis (the lowest such axis if
+    // there is a tie) is done identically by the sender and the receiver.
+
+    auto getChunk = [numChunks] (Region R, int chunk) -> Region
+    {
+        if (R.isEmpty())
+        {
+            return R;
+        }
+
+        auto shape = R.shape();
+        int axis = std::max_element (shape.begin(), shape.end()) - shape.begin();
+        int extent = shape[axis];
+        int lower = R.lower[axis] + extent * chunk / numChunks;
+        int upper = R.lower[axis] + extent * (chunk + 1) / numChunks;
+        return lower == upper ? Region::empty() : R.withRange (axis, lower, upper);
+    };
+
+    for (int c = 0; c < numChunks; ++c)
+    {
+        auto chunk = Internals::Chunk();
+
+        for (int rank = 0; rank < P; ++rank)
+        {
+            auto send = getChunk (sendRegions[rank], c);
+            auto recv = getChunk (recvRegions[rank], c);
+            int sendCount = send.isEmpty() ? 0 : send.size();
+            int recvCount = recv.isEmpty() ? 0 : recv.size();
+
+            chunk.sendRegions.push_back (send);
+            chunk.recvRegions.push_back (recv);
+            chunk.sendCounts.push_back (sendCount);
+            chunk.recvCounts.push_back (recvCount);
+            chunk.sendOffsets.push_back (chunk.sendTotal);
+            chunk.recvOffsets.push_back (chunk.recvTotal);
+            chunk.sendTotal += sendCount;
+            chunk.recvTotal += recvCount;
+        }
+        internals->chunks.push_back (chunk);
+    }
+}
+
+MpiRedistributionPlan::~MpiRedistributionPlan()
+{
+}
+
+void MpiRedistributionPlan::execute (const Array& source, Array& target) const
+{
+    assert (source.shape() == internals->sourceShape);
+    assert (target.shape() == internals->targetShape);
+
+    auto& I = *internals;
+    auto comm = I.communicator.internals->comm;
+    const int P = I.communicator.size();
+
+    if (I.method == Method::alltoallw)
+    {
+        const auto& chunk = I.chunks[0];
+        auto sendCounts = std::vector<int> (P);
+        auto recvCounts = std::vector<int> (P);
+        auto displacements = std::vector<int> (P, 0);
+        auto sendTypes = std::vector<MPI_Datatype> (P);
+        auto recvTypes = std::vector<MPI_Datatype> (P);
+
+        for (int rank = 0; rank < P; ++rank)
+        {
+            sendCounts[rank] = chunk.sendCounts[rank] ? 1 : 0;
+            recvCounts[rank] = chunk.recvCounts[rank] ? 1 : 0;
+            sendTypes[rank] = I.sendTypes[rank].internals->type;
+            recvTypes[rank] = I.recvTypes[rank].internals->type;
+        }
+
+        MPI_Alltoallw (
+            source.getAllocation().begin(), &sendCounts[0], &displacements[0], &sendTypes[0],
+            target.begin(), &recvCounts[0], &displacements[0], &recvTypes[0], comm);
+        return;
+    }
+
+    auto pack = [&] (int c)
+    {
+        const auto& chunk = I.chunks[c];
+        double* buffer = I.getBuffer (I.sendBuffers[c % 2], chunk.sendTotal);
+
+        for (int rank = 0; rank < P; ++rank)
+        {
+            if (chunk.sendCounts[rank])
+            {
+                source.packRegion (chunk.sendRegions[rank], buffer + chunk.sendOffsets[rank]);
+            }
+        }
+    };
+
+    auto unpack = [&] (int c)
+    {
+        const auto& chunk = I.chunks[c];
+        double* buffer = I.recvBuffers[c % 2].begin<double>();
+
+        for (int rank = 0; rank < P; ++rank)
+        {
+            if (chunk.recvCounts[rank])
+            {
+                target.unpackRegion (chunk.recvRegions[rank], buffer + chunk.recvOffsets[rank]);
+            }
+        }
+    };
+
+    auto post = [&] (int c, MPI_Request* request)
+    {
+        const auto& chunk = I.chunks[c];
+        MPI_Ialltoallv (
+            I.sendBuffers[c % 2].begin(), &chunk.sendCounts[0], &chunk.sendOffsets[0], MPI_DOUBLE,
+            I.getBuffer (I.recvBuffers[c % 2], chunk.recvTotal), &chunk.recvCounts[0], &chunk.recvOffsets[0], MPI_DOUBLE,
+            comm, request);
+    };
+
+    // While chunk c is in flight, chunk c + 1 is packed and posted, and
+    // then chunk c is unpacked. At most two chunks are in flight, so two
+    // sets of buffers suffice.
+
+    const int numChunks = I.chunks.size();
+    MPI_Request requests[2];
+
+    pack (0);
+    post (0, &requests[0]);
+
+    for (int c = 0; c < numChunks; ++c)
+    {
+        if (c + 1 < numChunks)
+        {
+            pack (c + 1);
+            post (c + 1, &requests[(c + 1) % 2]);
+        }
+        MPI_Wait (&requests[c % 2], MPI_STATUS_IGNORE);
+        unpack (c);
+    }
+}
+
 
 
 
@@ -306,20 +1694,353 @@ void MpiCartComm::shiftExchange (Array& A, int axis, char sendDirection, Region
 {
     assert (sendDirection == 'L' || sendDirection == 'R');
 
-    auto sendType = MpiDataType::subarray (A.shape(), send);
-    auto recvType = MpiDataType::subarray (A.shape(), recv);
-
     int sendRank = shift (axis, sendDirection == 'L' ? -1 : +1);
     int recvRank = shift (axis, sendDirection == 'L' ? +1 : -1);
 
     MPI_Status status;
 
+    if (internals->exchangeMode == ExchangeMode::sharedMemory)
+    {
+        sharedMemoryExchange (A, sendRank, recvRank, send, recv);
+        return;
+    }
+
+    if (internals->exchangeMode == ExchangeMode::rmaFence ||
+        internals->exchangeMode == ExchangeMode::rmaPscw)
+    {
+        rmaExchange (A, sendRank, recvRank, send, recv);
+        return;
+    }
+
+    if (shouldPackRegions (A, send, recv))
+    {
+        // Data types on the two ends of a message only need matching type
+        // signatures, so a packed buffer of n doubles may be received by a
+        // neighbor that is using a derived data type.
+        send.ensureAbsolute (A.shape());
+        recv.ensureAbsolute (A.shape());
+
+        int numThreads = internals->numPackingThreads;
+        auto sendBuffer = internals->getBuffer (internals->sendBuffer, send.size());
+        auto recvBuffer = internals->getBuffer (internals->recvBuffer, recv.size());
+
+        A.packRegion (send, sendBuffer, numThreads);
+
+        MPI_Sendrecv (
+            sendBuffer, send.size(), MPI_DOUBLE, sendRank, 12345,
+            recvBuffer, recv.size(), MPI_DOUBLE, recvRank, 12345,
+            internals->comm, &status);
+
+        A.unpackRegion (recv, recvBuffer, numThreads);
+        return;
+    }
+
+    auto sendType = MpiDataType::subarray (A.shape(), send);
+    auto recvType = MpiDataType::subarray (A.shape(), recv);
+
     MPI_Sendrecv (
         A.begin(), 1, sendType.internals->type, sendRank, 12345,
         A.begin(), 1, recvType.internals->type, recvRank, 12345,
         internals->comm, &status);
 }
 
+void MpiCartComm::setExchangeMode (ExchangeMode mode, int numPackingThreads)
+{
+    internals->exchangeMode = mode;
+    internals->numPackingThreads = numPackingThreads;
+    internals->packingIsFaster.clear();
+}
+
+MpiCartComm::ExchangeMode MpiCartComm::getExchangeMode() const
+{
+    return internals->exchangeMode;
+}
+
+bool MpiCartComm::isOnSameNode (int processRank) const
+{
+    splitByNode();
+    return internals->nodeRanks[processRank] != -1;
+}
+
+MpiCartComm MpiCartComm::duplicate() const
+{
+    return duplicateInternals();
+}
+
+std::vector<MpiCartComm> MpiCartComm::duplicateForThreads (int numThreads) const
+{
+    auto duplicates = std::vector<MpiCartComm>();
+
+    for (int n = 0; n < numThreads; ++n)
+    {
+        duplicates.push_back (duplicate());
+    }
+    return duplicates;
+}
+
+Array MpiCartComm::allocateForExchange (Shape shape) const
+{
+    switch (internals->exchangeMode)
+    {
+        case ExchangeMode::sharedMemory: return allocateShared (shape);
+        case ExchangeMode::rmaFence: return allocateWindow (shape);
+        case ExchangeMode::rmaPscw: return allocateWindow (shape);
+        default: return Array (shape);
+    }
+}
+
+bool MpiCartComm::canExchange (const Array& A) const
+{
+    switch (internals->exchangeMode)
+    {
+        case ExchangeMode::sharedMemory: return isSharedAllocation (A);
+        case ExchangeMode::rmaFence: return isWindowAllocation (A);
+        case ExchangeMode::rmaPscw: return isWindowAllocation (A);
+        default: return true;
+    }
+}
+
+void MpiCartComm::sharedMemoryExchange (Array& A, int sendRank, int recvRank, Region send, Region recv) const
+{
+    auto entry = internals->sharedWindows.find (A.begin());
+
+    if (entry == internals->sharedWindows.end())
+    {
+        throw std::logic_error ("arrays exchanged in shared memory mode must be created by allocateShared");
+    }
+
+    send.ensureAbsolute (A.shape());
+    recv.ensureAbsolute (A.shape());
+
+    const auto& shared = entry->second;
+    const auto& nodeRanks = internals->nodeRanks;
+    const MPI_Comm node = internals->node->comm;
+    const int sendNodeRank = sendRank == MPI_PROC_NULL ? -1 : nodeRanks[sendRank];
+    const int recvNodeRank = recvRank == MPI_PROC_NULL ? -1 : nodeRanks[recvRank];
+
+    int thisNodeRank;
+    MPI_Comm_rank (node, &thisNodeRank);
+
+    auto header = reinterpret_cast<SharedSegmentHeader*> (shared.segments[thisNodeRank]);
+    std::copy (send.lower.begin(), send.lower.end(), header->lower);
+    std::copy (send.upper.begin(), send.upper.end(), header->upper);
+    std::copy (send.stride.begin(), send.stride.end(), header->stride);
+
+    // Neighbors on other nodes are reached by messages, which are posted
+    // before waiting for the processes on this node.
+    auto sendType = MpiDataType::subarray (A.shape(), send);
+    auto recvType = MpiDataType::subarray (A.shape(), recv);
+    MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+
+    if (recvNodeRank == -1)
+    {
+        MPI_Irecv (A.begin(), 1, recvType.internals->type, recvRank, 12345, internals->comm, &requests[0]);
+    }
+    if (sendNodeRank == -1)
+    {
+        MPI_Isend (A.begin(), 1, sendType.internals->type, sendRank, 12345, internals->comm, &requests[1]);
+    }
+
+    MPI_Win_sync (shared.window);
+    MPI_Barrier (node);
+    MPI_Win_sync (shared.window);
+
+    if (recvNodeRank != -1)
+    {
+        auto source = reinterpret_cast<const SharedSegmentHeader*> (shared.segments[recvNodeRank]);
+        auto sourceShape = Shape();
+        auto sourceRegion = Region();
+
+        for (int n = 0; n < 5; ++n)
+        {
+            sourceShape[n] = source->shape[n];
+            sourceRegion.lower[n] = source->lower[n];
+            sourceRegion.upper[n] = source->upper[n];
+            sourceRegion.stride[n] = source->stride[n];
+        }
+
+        if (sourceRegion.shape() != recv.shape())
+        {
+            throw std::logic_error ("shared memory exchange requires send and receive regions of the same shape");
+        }
+        auto sourceData = reinterpret_cast<const double*> (shared.segments[recvNodeRank] + sharedHeaderSize);
+        copyRegion (sourceData, sourceShape, sourceRegion, A.begin(), A.shape(), recv);
+    }
+
+    MPI_Waitall (2, requests, MPI_STATUSES_IGNORE);
+
+    // No process may modify its array until its neighbors are done loading.
+    MPI_Win_sync (shared.window);
+    MPI_Barrier (node);
+}
+
+void MpiCartComm::rmaExchange (Array& A, int sendRank, int recvRank, Region send, Region recv) const
+{
+    auto entry = internals->exposedWindows.find (A.begin());
+
+    if (entry == internals->exposedWindows.end())
+    {
+        throw std::logic_error ("arrays exchanged in RMA mode must be created by allocateWindow");
+    }
+
+    send.ensureAbsolute (A.shape());
+    recv.ensureAbsolute (A.shape());
+
+    // Tell the process that puts into this one where its data goes, and
+    // learn the same from the process this one puts into. This is done on
+    // every exchange, since the neighbor's block may have changed while
+    // this one's has not (after DistributedArray::rebalance, for example).
+    int mine[20];
+    int theirs[20];
+
+    for (int n = 0; n < 5; ++n)
+    {
+        mine[n +  0] = A.size (n);
+        mine[n +  5] = recv.lower[n];
+        mine[n + 10] = recv.upper[n];
+        mine[n + 15] = recv.stride[n];
+    }
+
+    MPI_Sendrecv (
+        mine, 20, MPI_INT, recvRank, 12346,
+        theirs, 20, MPI_INT, sendRank, 12346,
+        internals->comm, MPI_STATUS_IGNORE);
+
+    auto key = std::vector<int> (theirs, theirs + 20);
+
+    for (int n = 0; n < 5; ++n)
+    {
+        key.insert (key.end(), {A.size (n), send.lower[n], send.upper[n], send.stride[n]});
+    }
+
+    auto cached = internals->rmaTransfers.find (key);
+
+    if (cached == internals->rmaTransfers.end())
+    {
+        auto targetShape = Shape();
+        auto targetRegion = Region();
+
+        for (int n = 0; n < 5; ++n)
+        {
+            targetShape[n] = theirs[n];
+            targetRegion.lower[n] = theirs[n + 5];
+            targetRegion.upper[n] = theirs[n + 10];
+            targetRegion.stride[n] = theirs[n + 15];
+        }
+
+        if (targetRegion.size() != send.size())
+        {
+            throw std::logic_error ("RMA exchange requires send and receive regions of the same size");
+        }
+
+        auto transfer = Internals::RmaTransfer();
+        transfer.origin = MpiDataType::subarray (A.shape(), send);
+        transfer.target = MpiDataType::subarray (targetShape, targetRegion);
+        cached = internals->rmaTransfers.emplace (key, transfer).first;
+    }
+
+    const MPI_Win window = entry->second;
+    const MPI_Datatype originType = cached->second.origin.internals->type;
+    const MPI_Datatype targetType = cached->second.target.internals->type;
+
+    if (internals->exchangeMode == ExchangeMode::rmaFence)
+    {
+        // Every exchange closes its own epoch, so none precedes the first
+        // fence or follows the second.
+        MPI_Win_fence (MPI_MODE_NOPRECEDE, window);
+        MPI_Put (A.begin(), 1, originType, sendRank, 0, 1, targetType, window);
+        MPI_Win_fence (MPI_MODE_NOSUCCEED, window);
+    }
+    else
+    {
+        MPI_Group group;
+        MPI_Group targetGroup;
+        MPI_Group originGroup;
+        MPI_Comm_group (internals->comm, &group);
+        MPI_Group_incl (group, 1, &sendRank, &targetGroup);
+        MPI_Group_incl (group, 1, &recvRank, &originGroup);
+
+        MPI_Win_post (originGroup, 0, window);
+        MPI_Win_start (targetGroup, 0, window);
+        MPI_Put (A.begin(), 1, originType, sendRank, 0, 1, targetType, window);
+        MPI_Win_complete (window);
+        MPI_Win_wait (window);
+
+        MPI_Group_free (&originGroup);
+        MPI_Group_free (&targetGroup);
+        MPI_Group_free (&group);
+    }
+}
+
+bool MpiCartComm::shouldPackRegions (Array& A, Region send, Region recv) const
+{
+    switch (internals->exchangeMode)
+    {
+        case ExchangeMode::datatype: return false;
+        case ExchangeMode::packed: return true;
+        case ExchangeMode::automatic: break;
+        case ExchangeMode::sharedMemory: return false;
+        case ExchangeMode::rmaFence: return false;
+        case ExchangeMode::rmaPscw: return false;
+    }
+
+    send.ensureAbsolute (A.shape());
+    recv.ensureAbsolute (A.shape());
+
+    auto key = std::vector<int>();
+
+    for (int n = 0; n < 5; ++n)
+    {
+        key.insert (key.end(), {
+            A.size (n),
+            send.lower[n], send.upper[n], send.stride[n],
+            recv.lower[n], recv.upper[n], recv.stride[n] });
+    }
+
+    auto cached = internals->packingIsFaster.find (key);
+
+    if (cached != internals->packingIsFaster.end())
+    {
+        return cached->second;
+    }
+
+    // Time a local round trip through each strategy. MPI_Pack and
+    // MPI_Unpack stand in for the packing MPI does inside a send and receive
+    // with derived data types. The receive region is about to be
+    // overwritten by the exchange, so it is safe to unpack into it here.
+
+    const int numTrials = 4;
+    auto sendType = MpiDataType::subarray (A.shape(), send);
+    auto recvType = MpiDataType::subarray (A.shape(), recv);
+    auto buffer = internals->getBuffer (internals->sendBuffer, std::max (send.size(), recv.size()));
+    int bufferBytes = internals->sendBuffer.size();
+    int numThreads = internals->numPackingThreads;
+    double datatypeTime = 0.0;
+    double packingTime = 0.0;
+
+    for (int trial = 0; trial <= numTrials; ++trial)
+    {
+        // The first trial warms up caches and any lazily built MPI state,
+        // and is not counted.
+        double t0 = MPI_Wtime();
+        int position = 0;
+        MPI_Pack (A.begin(), 1, sendType.internals->type, buffer, bufferBytes, &position, internals->comm);
+        position = 0;
+        MPI_Unpack (buffer, bufferBytes, &position, A.begin(), 1, recvType.internals->type, internals->comm);
+        double t1 = MPI_Wtime();
+        A.packRegion (send, buffer, numThreads);
+        A.unpackRegion (recv, buffer, numThreads);
+        double t2 = MPI_Wtime();
+
+        if (trial > 0)
+        {
+            datatypeTime += t1 - t0;
+            packingTime += t2 - t1;
+        }
+    }
+    return internals->packingIsFaster[key] = packingTime < datatypeTime;
+}
+
 
 
 
@@ -337,10 +2058,14 @@ MpiDataType MpiDataType::nativeDouble()
 MpiDataType MpiDataType::subarray (Shape S, Region R)
 {
     R = R.absolute (S);
-    int ndims = R.getShapeVector().size();
+
+    // All five axes are described, since a region of size 1 on a trailing
+    // axis may still start at a non-zero index.
+    int ndims = 5;
     auto sizes = std::vector<int>();
     auto subsizes = std::vector<int>();
     auto starts = std::vector<int>();
+    bool isStrided = false;
 
     for (int n = 0; n < ndims; ++n)
     {
@@ -348,7 +2073,12 @@ MpiDataType MpiDataType::subarray (Shape S, Region R)
         sizes.push_back (S[n]);
         subsizes.push_back (range.size());
         starts.push_back (range.lower);
-        assert (range.stride == 1);
+        isStrided |= range.stride != 1;
+    }
+
+    if (isStrided)
+    {
+        return strided (S, R);
     }
 
     MPI_Datatype type;
@@ -364,6 +2094,46 @@ MpiDataType MpiDataType::subarray (Shape S, Region R)
     return new Internals (type, true);
 }
 
+MpiDataType MpiDataType::strided (Shape S, Region R)
+{
+    R = R.absolute (S);
+
+    // The type is built from the innermost axis outward. Each level is an
+    // hvector of the level below it, so its byte stride is the array's
+    // memory stride on that axis times the region's stride. The region's
+    // starting offset is applied at the end through an hindexed type.
+
+    auto strides = Shape {{ S[1] * S[2] * S[3] * S[4], S[2] * S[3] * S[4], S[3] * S[4], S[4], 1 }};
+    auto offset = MPI_Aint (0);
+    auto extent = MPI_Aint (sizeof (double));
+
+    MPI_Datatype type;
+    MPI_Type_dup (MPI_DOUBLE, &type);
+
+    for (int n = 4; n >= 0; --n)
+    {
+        auto range = R.range (n);
+        auto stride = MPI_Aint (strides[n] * range.stride * sizeof (double));
+        MPI_Datatype outer;
+        MPI_Type_create_hvector (range.size(), 1, stride, type, &outer);
+        MPI_Type_free (&type);
+        type = outer;
+        offset += range.lower * strides[n] * sizeof (double);
+        extent *= S[n];
+    }
+
+    int blockLength = 1;
+    MPI_Datatype shifted;
+    MPI_Datatype resized;
+    MPI_Type_create_hindexed (1, &blockLength, &offset, type, &shifted);
+    MPI_Type_create_resized (shifted, 0, extent, &resized);
+    MPI_Type_commit (&resized);
+    MPI_Type_free (&type);
+    MPI_Type_free (&shifted);
+
+    return new Internals (resized, true);
+}
+
 MpiDataType::MpiDataType()
 {
 
@@ -387,12 +2157,88 @@ std::size_t MpiDataType::size() const
 
 
 // ============================================================================
-MpiSession::MpiSession (int argc, char** argv)
+static int getMpiThreadLevel (MpiSession::ThreadSupport level)
 {
-    MPI_Init (&argc, &argv);
+    switch (level)
+    {
+        case MpiSession::ThreadSupport::single: return MPI_THREAD_SINGLE;
+        case MpiSession::ThreadSupport::funneled: return MPI_THREAD_FUNNELED;
+        case MpiSession::ThreadSupport::serialized: return MPI_THREAD_SERIALIZED;
+        case MpiSession::ThreadSupport::multiple: return MPI_THREAD_MULTIPLE;
+    }
+    return MPI_THREAD_SINGLE;
+}
+
+MpiSession::MpiSession (int argc, char** argv, ThreadSupport required)
+{
+    int provided;
+    MPI_Init_thread (&argc, &argv, getMpiThreadLevel (required), &provided);
+
+    if (getThreadSupport() < required && MpiCommunicator::world().isThisMaster())
+    {
+        std::cerr
+        << "[MpiSession] requested "
+        << getName (required)
+        << " but the MPI library provides "
+        << getName (getThreadSupport())
+        << std::endl;
+    }
 }
 
 MpiSession::~MpiSession()
 {
+    stopProgressThread();
+
+    if (numLiveWindows > 0)
+    {
+        std::cerr
+        << "[MpiSession] "
+        << numLiveWindows
+        << " window allocation(s) outlived the session; arrays from allocateShared"
+        << " and allocateWindow must be released before MPI_Finalize"
+        << std::endl;
+    }
     MPI_Finalize();
 }
+
+MpiSession::ThreadSupport MpiSession::getThreadSupport()
+{
+    int provided;
+    MPI_Query_thread (&provided);
+
+    if (provided == MPI_THREAD_MULTIPLE) return ThreadSupport::multiple;
+    if (provided == MPI_THREAD_SERIALIZED) return ThreadSupport::serialized;
+    if (provided == MPI_THREAD_FUNNELED) return ThreadSupport::funneled;
+    return ThreadSupport::single;
+}
+
+void MpiSession::startProgressThread (int intervalMicroseconds)
+{
+    if (getThreadSupport() != ThreadSupport::multiple)
+    {
+        throw std::runtime_error ("the progress thread requires MPI_THREAD_MULTIPLE");
+    }
+    getProgressEngine().start (intervalMicroseconds);
+}
+
+void MpiSession::stopProgressThread()
+{
+    getProgressEngine().stop();
+}
+
+int MpiSession::progress()
+{
+    return getProgressEngine().poll();
+}
+
+const char* MpiSession::getName (ThreadSupport level)
+{
+    switch (level)
+    {
+        case ThreadSupport::single: return "MPI_THREAD_SINGLE";
+        case ThreadSupport::funneled: return "MPI_THREAD_FUNNELED";
+        case ThreadSupport::serialized: return "MPI_THREAD_SERIALIZED";
+        case ThreadSupport::multiple: return "MPI_THREAD_MULTIPLE";
+    }
+    return "";
+}
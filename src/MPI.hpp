@@ -4,6 +4,7 @@
 #include <memory>
 #include <vector>
 #include <functional>
+#include <map>
 #include "Array.hpp"
 
 
@@ -14,6 +15,8 @@ namespace Cow
     class MpiCommunicator;
     class MpiCartComm;
     class MpiDataType;
+    class MpiReductionBatch;
+    class MpiRedistributionPlan;
     class MpiRequest;
     class MpiSession;
 
@@ -52,6 +55,12 @@ namespace Cow
         */
         ~MpiRequest();
 
+        /**
+        Move constructor. The moved-from request no longer refers to an MPI
+        request handle.
+        */
+        MpiRequest (MpiRequest&& other);
+
         /**
         Cancels the request. It is safe for the requeset to go out of scope
         after this call.
@@ -83,8 +92,18 @@ namespace Cow
         */
         bool getStatus() const;
 
+        /**
+        Register this request with the progress engine, so that it is driven
+        forward by MpiSession::progress and by the session's progress thread
+        while the caller computes. It is unregistered when it completes
+        through wait or test, or goes out of scope.
+        */
+        void enableProgress();
+
     private:
         friend class MpiCommunicator;
+        friend class MpiReductionBatch;
+        friend class MpiRedistributionPlan;
         struct Internals;
         MpiRequest (Internals*);
         std::unique_ptr<Internals> internals;
@@ -97,6 +116,11 @@ namespace Cow
     class MpiCommunicator
     {
     public:
+        /**
+        Element-wise operations supported by the reduction methods.
+        */
+        enum class Reduction { minimum, maximum, sum };
+
         static MpiCommunicator world();
 
         /**
@@ -127,12 +151,67 @@ namespace Cow
         */
         bool isThisMaster() const { return rank() == 0; }
 
+#ifdef MPI_VERSION
+        /**
+        Return the underlying MPI communicator, for libraries built on MPI
+        (parallel HDF5, for example). This is only declared where mpi.h is
+        included before this header.
+        */
+        MPI_Comm getMpiComm() const;
+#endif
+
         /**
         Execute the given function on each process in sequence. The callback
-        is given the rank.
+        is given the rank. Each process waits for a message from the one
+        before it, so this takes time proportional to the number of
+        processes. It is meant for side effects that must not overlap, such
+        as appending to one file; to print in rank order, use the overload
+        below, which scales with the logarithm of the number of processes.
         */
         void inSequence (std::function<void (int)> callback) const;
 
+        /**
+        Execute the given function on all processes at once, each writing to
+        its own buffer, then write the buffers to the given stream on the
+        master, in rank order. The buffers are collected with gatherInOrder,
+        so this scales with the logarithm of the number of processes.
+        */
+        void inSequence (std::ostream& stream, std::function<void (int, std::ostream&)> callback) const;
+
+        /**
+        Collect a payload from every process onto the master, and return them
+        there in rank order; other processes get an empty vector. Payloads
+        may have different sizes. They are gathered with MPI_Gatherv, first
+        onto the leader of each node (see splitByNodeLeaders) and then from
+        the leaders onto the master. This is a collective operation.
+        */
+        std::vector<HeapAllocation> gatherInOrder (const HeapAllocation& payload) const;
+
+        /**
+        Algorithms for exchangeSparse. With nbx (the non-blocking consensus
+        of Hoefler et al.), payloads are sent by MPI_Issend, received as they
+        are probed, and an MPI_Ibarrier is entered once all of this process's
+        sends have been matched; the exchange is over when the barrier
+        completes. No process learns more than the messages it receives.
+        With alltoallv, the payload sizes are exchanged by MPI_Alltoall and
+        the payloads by MPI_Alltoallv, which needs arrays of one entry per
+        process, but may be faster for dense patterns on small communicators.
+        */
+        enum class SparseExchange { nbx, alltoallv };
+
+        /**
+        Send each payload in the given map to the rank it is keyed by, and
+        return the payloads sent to this process, keyed by the rank of their
+        source. Processes do not need to know which ranks will send to them.
+        Payloads may be empty, in which case an empty payload is received.
+        The messages go over a duplicate of this communicator, so they do
+        not mix with other traffic, or with those of an earlier or later
+        exchange. This is a collective operation.
+        */
+        std::map<int, HeapAllocation> exchangeSparse (
+            const std::map<int, HeapAllocation>& outgoing,
+            SparseExchange method=SparseExchange::nbx) const;
+
         /**
         Execute the given function on the master process, while other processes
         wait.
@@ -145,14 +224,97 @@ namespace Cow
         is empty, then the topology will be distributed on all ndims axes.
         Otherwise, the axes n for which (axisIsDistributed[n] == false) will
         have size 1 in the communicator.
+
+        If nodeAware is true, the grid of processes is factored into a grid
+        of nodes times a grid of processes on each node, choosing the
+        factors that minimize the number of block faces shared between
+        nodes, and ranks are placed so that each node holds one contiguous
+        sub-grid. This needs the same number of processes on every node;
+        otherwise the placement is left to MPI, as when nodeAware is false.
         */
-        MpiCartComm createCartesian (int ndims, std::vector<bool> axisIsDistributed={}) const;
+        MpiCartComm createCartesian (int ndims, std::vector<bool> axisIsDistributed={}, bool nodeAware=false) const;
 
         /**
         Create a new communicator by calling MPI_Comm_split, with the given color.
         */
         MpiCommunicator split (int color) const;
 
+        /**
+        Return a new communicator with the same processes (and topology), by
+        MPI_Comm_dup. It has its own message context, so that messages on
+        the two never match, and its own exchange buffers and settings,
+        which start as copies of this one's. This is a collective operation.
+        */
+        MpiCommunicator duplicate() const;
+
+        /**
+        Return one duplicate of this communicator for each of the given
+        number of threads. Threads that communicate concurrently, each
+        through its own duplicate, need MpiSession::ThreadSupport::multiple.
+        This is a collective operation.
+        */
+        std::vector<MpiCommunicator> duplicateForThreads (int numThreads) const;
+
+        /**
+        Return a vector, with one entry for each rank of this communicator,
+        containing the rank of the same process in the other communicator,
+        or -1 if that process is not a member of it.
+        */
+        std::vector<int> translateRanks (const MpiCommunicator& other) const;
+
+        /**
+        Return a communicator of the processes in this one that can share
+        memory with this process (MPI_Comm_split_type with
+        MPI_COMM_TYPE_SHARED). It is created on the first call and cached.
+        This is a collective operation the first time it is called.
+        */
+        MpiCommunicator splitByNode() const;
+
+        /**
+        Return a communicator of the node leaders: the first process of each
+        node, i.e. rank 0 of splitByNode(), ordered by rank in this
+        communicator. The master is always a leader. Processes which are not
+        leaders get an invalid communicator. It is created on the first call
+        and cached. This is a collective operation the first time it is
+        called.
+        */
+        MpiCommunicator splitByNodeLeaders() const;
+
+        /**
+        Return a zero-initialized array whose memory lies in an MPI-3 shared
+        memory window (MPI_Win_allocate_shared) over the processes of
+        splitByNode(), so that they may load from it directly. Each process
+        passes its own shape. The window is freed when the array's memory is
+        released, which must happen on all processes of the node together,
+        and before the MpiSession ends. Copy-assigning an array of a
+        different size to it raises std::logic_error. This is a collective
+        operation.
+        */
+        Array allocateShared (Shape shape) const;
+
+        /**
+        Return true if the memory of A was created by allocateShared on this
+        communicator (or a copy of it).
+        */
+        bool isSharedAllocation (const Array& A) const;
+
+        /**
+        Return a zero-initialized array whose memory is exposed to the other
+        processes of this communicator for one-sided access, through an MPI
+        window created by MPI_Win_allocate. The window is freed when the
+        array's memory is released, which must happen on all processes
+        together, and before the MpiSession ends. Copy-assigning an array of
+        a different size to it raises std::logic_error. This is a collective
+        operation.
+        */
+        Array allocateWindow (Shape shape) const;
+
+        /**
+        Return true if the memory of A was created by allocateWindow on this
+        communicator (or a copy of it).
+        */
+        bool isWindowAllocation (const Array& A) const;
+
         /**
         Return the minimum value over all participating processes, to all
         processes. This invokes an MPI_Allreduce opertion.
@@ -171,6 +333,47 @@ namespace Cow
         */
         std::vector<double> sum (const std::vector<double>& A) const;
 
+        /**
+        Return the sum of an integer count over all participating ranks, to
+        all processes, exactly. This invokes an MPI_Allreduce operation on
+        MPI_LONG.
+        */
+        long sum (long x) const;
+
+        /**
+        Reduce the contents of A element-wise over all participating ranks,
+        in place, in three stages: the processes of each node store their
+        values in an MPI-3 shared memory window over splitByNode(), where the
+        node leader combines them; the leaders combine theirs with an
+        MPI_Allreduce over splitByNodeLeaders(); and each process loads the
+        result from its leader's segment. Only the leaders send messages, so
+        the latency grows with the number of nodes rather than processes.
+        The window is created on the first call and cached, and is grown
+        when a larger array is reduced. This is a collective operation.
+        */
+        void allreduceHierarchical (Array& A, Reduction operation) const;
+
+        /**
+        Make minimum, maximum, and sum go through allreduceHierarchical
+        rather than a flat MPI_Allreduce. The default is false. Duplicates
+        of this communicator inherit the setting.
+        */
+        void setHierarchicalReductions (bool shouldUseHierarchical);
+
+        /**
+        Reduce the contents of A element-wise over all participating ranks,
+        in place, so that every rank ends up with the result. This is an
+        MPI_Allreduce on the array's buffer, with no temporary copy.
+        */
+        void allreduce (Array& A, Reduction operation) const;
+
+        /**
+        Non-blocking version of allreduce, through MPI_Iallreduce. A must stay
+        alive, and must not be read or modified, until the returned request
+        has completed.
+        */
+        MpiRequest postAllreduce (Array& A, Reduction operation) const;
+
         /**
         These methods are a draft of an interface for synchronous and
         asynchronous send and receive operations. They are not implemented yet.
@@ -182,9 +385,170 @@ namespace Cow
         HeapAllocation receive (int rank, int tag=0) const;
         MpiRequest request (int rank, int tag=0) const;
 
+        /**
+        Send the given region of A to another rank. The region may be relative
+        or absolute, and may be strided on any axis. It is described to MPI
+        through a derived data type (see MpiDataType::subarray), so no packing
+        copy is made. The receiving rank must expect the same number of
+        doubles.
+        */
+        void send (const Array& A, Region R, int rank, int tag=0) const;
+
+        /**
+        Non-blocking version of send. A must not be modified until the
+        returned request has completed.
+        */
+        MpiRequest post (const Array& A, Region R, int rank, int tag=0) const;
+
+        /**
+        Receive data from another rank into the given region of A, which may
+        be relative or absolute, and may be strided.
+        */
+        void receive (Array& A, Region R, int rank, int tag=0) const;
+
+        /**
+        Non-blocking version of receive. The region of A is not valid until
+        the returned request has completed.
+        */
+        MpiRequest request (Array& A, Region R, int rank, int tag=0) const;
+
     protected:
+        friend class MpiReductionBatch;
+        friend class MpiRedistributionPlan;
         struct Internals;
         MpiCommunicator (Internals*);
+        Internals* duplicateInternals() const;
+        std::shared_ptr<Internals> internals;
+    };
+
+
+
+    /**
+    Class to gather many small reductions, each of which may be a minimum,
+    maximum, or sum, of a scalar or of an array, into a single collective.
+    Typical use is for per-step diagnostics:
+
+        auto batch = MpiReductionBatch (comm);
+        auto dt = batch.add (localTimestep, MpiCommunicator::Reduction::minimum);
+        auto mass = batch.add (localMass, MpiCommunicator::Reduction::sum);
+        batch.reduce();
+        double globalTimestep = batch.getResult (dt);
+
+    Each entry travels with a tag identifying its operation, and a
+    user-defined MPI operation applies the right one to each entry, so that
+    the whole batch is reduced in a single MPI_Allreduce or MPI_Iallreduce.
+    */
+    class MpiReductionBatch
+    {
+    public:
+        /**
+        Create an empty batch which will reduce over the given communicator.
+        */
+        MpiReductionBatch (MpiCommunicator communicator);
+       ~MpiReductionBatch();
+
+        /**
+        Add a scalar to the batch, and return the index of its result.
+        */
+        int add (double x, MpiCommunicator::Reduction operation);
+
+        /**
+        Add each element of an array to the batch, and return the index of
+        the result for its first element. The others follow it in order.
+        */
+        int add (const Array& A, MpiCommunicator::Reduction operation);
+
+        /**
+        Return the number of entries in the batch.
+        */
+        int size() const;
+
+        /**
+        Remove all entries, so that the batch may be reused.
+        */
+        void clear();
+
+        /**
+        Reduce all of the entries in a single blocking collective.
+        */
+        void reduce();
+
+        /**
+        Non-blocking version of reduce. The results are not valid, and no
+        entries may be added, until the returned request has completed.
+        */
+        MpiRequest post();
+
+        /**
+        Return the reduced value at the given index.
+        */
+        double getResult (int index) const;
+
+        /**
+        Copy A.size() reduced values, starting at the given index, into A.
+        */
+        void getResult (int index, Array& A) const;
+
+    private:
+        struct Internals;
+        MpiCommunicator communicator;
+        std::shared_ptr<Internals> internals;
+    };
+
+
+
+    /**
+    A precomputed all-to-all exchange, in which each rank sends one region
+    of a source array to each other rank, and receives one region of a
+    target array from each other rank. This is the engine behind global
+    transposes, such as moving a field from a block decomposition to a
+    pencil decomposition (see DistributedArray::planRedistribution).
+
+    All of the regions, counts, offsets, and data types are worked out when
+    the plan is constructed, and the pack buffers are owned by the plan and
+    reused, so that executing it repeatedly does no allocation.
+    */
+    class MpiRedistributionPlan
+    {
+    public:
+        /**
+        Strategies for executing the exchange. With 'alltoallw', each region
+        is described by a derived data type and MPI_Alltoallw moves the data
+        with no packing copy in Cow. With 'alltoallv', regions are packed
+        into contiguous buffers for a single MPI_Alltoallv. With 'pipelined',
+        every region is split into chunks, and each chunk is exchanged with
+        MPI_Ialltoallv while the next chunk is packed and the previous one
+        is unpacked into the target array.
+        */
+        enum class Method { alltoallw, alltoallv, pipelined };
+
+        /**
+        Default constructor, creates an unusable plan.
+        */
+        MpiRedistributionPlan();
+
+        /**
+        Create a plan over the given communicator. The send and receive
+        region vectors have one entry for each rank of the communicator.
+        Entries are absolute, unit stride regions of the source and target
+        arrays respectively, or Region::empty() where no data is exchanged.
+        The regions a pair of ranks exchange must have the same shape. The
+        number of chunks is used only by the pipelined method.
+        */
+        MpiRedistributionPlan (MpiCommunicator communicator,
+            Shape sourceShape, std::vector<Region> sendRegions,
+            Shape targetShape, std::vector<Region> recvRegions,
+            Method method=Method::alltoallv, int numChunks=4);
+       ~MpiRedistributionPlan();
+
+        /**
+        Execute the exchange. The source and target arrays must have the
+        shapes the plan was created with. This is a collective operation.
+        */
+        void execute (const Array& source, Array& target) const;
+
+    private:
+        struct Internals;
         std::shared_ptr<Internals> internals;
     };
 
@@ -196,6 +560,31 @@ namespace Cow
     class MpiCartComm : public MpiCommunicator
     {
     public:
+        /**
+        Strategies used by shiftExchange to move the send and receive
+        regions. With 'datatype', the regions are described to MPI by derived
+        data types and MPI does any packing internally. With 'packed', they
+        are copied through contiguous buffers owned by the communicator,
+        using Array::packRegion and Array::unpackRegion. With 'automatic',
+        the faster of the two is chosen the first time each combination of
+        array shape and regions is exchanged, by briefly timing both.
+
+        With 'sharedMemory', the array must have been created by
+        allocateShared. A process whose neighbor is on the same node copies
+        the neighbor's send region straight out of its window, and only
+        neighbors on other nodes exchange messages. The processes of each
+        node synchronize before and after the copies.
+
+        With 'rmaFence' and 'rmaPscw', the array must have been created by
+        allocateWindow, and the send region is written straight into the
+        neighbor's receive region by MPI_Put. The epoch is opened and closed
+        by MPI_Win_fence, or by post-start-complete-wait with just the two
+        neighbors. Each exchange first swaps a short message with the
+        neighbors, telling them the shape of this process's array and its
+        receive region; the derived data types built from them are cached.
+        */
+        enum class ExchangeMode { datatype, packed, automatic, sharedMemory, rmaFence, rmaPscw };
+
         /**
         Default constructor. This constructor will initialize the communicator
         to MPI_COMM_NULL, and is only here so that user classes do not need to
@@ -233,6 +622,13 @@ namespace Cow
         */
         std::vector<int> getCoordinates (int processRank=-1) const;
 
+        /**
+        Return true if the process with the given rank in this communicator
+        is on the same node as this process (see splitByNode). This is a
+        collective operation the first time node information is needed.
+        */
+        bool isOnSameNode (int processRank) const;
+
         /**
         Execute an MPI send-recv operation by shifting the cartesian topology
         along the given axis. Data will be sent in the direction specified, by
@@ -240,12 +636,57 @@ namespace Cow
         region of A covered by 'send' is sent to the process on the right,
         while data in the 'recv' region of A is over-written with data
         received from the process to the left. The send and receive regions
-        may be relative or absolute, but must not overlap.
+        may be relative or absolute, and may be strided (e.g. a single
+        component along axis 3), but must not overlap.
         */
         void shiftExchange (Array& A, int axis, char sendDirection, Region send, Region recv) const;
 
+        /**
+        Set the strategy used by shiftExchange, and the number of threads the
+        pack and unpack kernels may use for large regions. The default mode
+        is ExchangeMode::datatype. Changing the mode discards the results of
+        any earlier automatic timings.
+        */
+        void setExchangeMode (ExchangeMode mode, int numPackingThreads=1);
+
+        /**
+        Return the strategy currently used by shiftExchange.
+        */
+        ExchangeMode getExchangeMode() const;
+
+        /**
+        Return a duplicate of this communicator, with the same topology
+        (see MpiCommunicator::duplicate). This is a collective operation.
+        */
+        MpiCartComm duplicate() const;
+
+        /**
+        Return one duplicate of this communicator for each of the given
+        number of threads, so that each thread may exchange halos
+        concurrently with the others. This is a collective operation.
+        */
+        std::vector<MpiCartComm> duplicateForThreads (int numThreads) const;
+
+        /**
+        Return a zero-initialized array that can be passed to shiftExchange
+        in the current exchange mode: created by allocateShared in
+        sharedMemory mode, by allocateWindow in the RMA modes, and in
+        ordinary memory otherwise. This is a collective operation in the
+        modes that need a window.
+        */
+        Array allocateForExchange (Shape shape) const;
+
+        /**
+        Return true if A can be passed to shiftExchange in the current
+        exchange mode.
+        */
+        bool canExchange (const Array& A) const;
+
     private:
         MpiCartComm (Internals*);
+        bool shouldPackRegions (Array& A, Region send, Region recv) const;
+        void sharedMemoryExchange (Array& A, int sendRank, int recvRank, Region send, Region recv) const;
+        void rmaExchange (Array& A, int sendRank, int recvRank, Region send, Region recv) const;
         friend class MpiCommunicator;
     };
 
@@ -262,11 +703,21 @@ namespace Cow
 
         /**
         Create a new MPI array data type, of doubles, which corresponds to the
-        given absolute region. The returned array data type has C ordering.
-        The region must have stride length equal to 1 on each axis.
+        given relative or absolute region. The returned array data type has C
+        ordering. If the region is not strided, this is an
+        MPI_Type_create_subarray type. Otherwise it is the type returned by
+        strided().
         */
         static MpiDataType subarray (Cow::Shape S, Cow::Region R);
 
+        /**
+        Create a data type for the given region, built from nested
+        MPI_Type_create_hvector calls (one per axis) so that any stride is
+        allowed. Like a subarray type, its extent is the whole array, so a
+        count of 1 applied to the array's first element describes the region.
+        */
+        static MpiDataType strided (Cow::Shape S, Cow::Region R);
+
         /**
         Default constructor, creates an unusable data type.
         */
@@ -279,7 +730,9 @@ namespace Cow
         std::size_t size() const;
 
     protected:
+        friend class MpiCommunicator;
         friend class MpiCartComm;
+        friend class MpiRedistributionPlan;
         struct Internals;
         MpiDataType (Internals*);
         std::shared_ptr<Internals> internals;
@@ -293,13 +746,64 @@ namespace Cow
     of these in the main() function, and MPI will be initialized. It is
     finalized when this object goes out of scope. Be sure to only create one
     of these in your application. Most MPI implementations do not allow
-    MPI_Init to be called again after MPI_Finalize.
+    MPI_Init to be called again after MPI_Finalize. Arrays created by
+    allocateShared or allocateWindow must be released before then; a
+    warning is printed if any are left.
     */
     class MpiSession
     {
     public:
-        MpiSession (int argc=0, char** argv=nullptr);
+        /**
+        Levels of thread support, in increasing order, corresponding to
+        MPI_THREAD_SINGLE, MPI_THREAD_FUNNELED, MPI_THREAD_SERIALIZED, and
+        MPI_THREAD_MULTIPLE. With 'funneled', only the thread that created
+        the session may call MPI. With 'serialized', any thread may, but not
+        two at once. With 'multiple', any threads may call MPI concurrently.
+        */
+        enum class ThreadSupport { single, funneled, serialized, multiple };
+
+        /**
+        Initialize MPI through MPI_Init_thread, requesting the given level of
+        thread support. The MPI library may grant a lower level, in which
+        case a warning is printed by rank 0; call getThreadSupport to find
+        out what was granted.
+        */
+        MpiSession (int argc=0, char** argv=nullptr, ThreadSupport required=ThreadSupport::single);
         ~MpiSession();
+
+        /**
+        Return the level of thread support granted by the MPI library.
+        */
+        static ThreadSupport getThreadSupport();
+
+        /**
+        Return the name of a thread support level, e.g. "MPI_THREAD_MULTIPLE".
+        */
+        static const char* getName (ThreadSupport level);
+
+        /**
+        Start a background thread which drives registered requests (see
+        MpiRequest::enableProgress) by calling MPI_Testsome on them, then
+        sleeping for the given interval. This lets non-blocking messages
+        progress during long computations, on MPI libraries that only make
+        progress inside MPI calls. It requires ThreadSupport::multiple, and
+        throws otherwise. The thread is stopped by stopProgressThread, or
+        when the session ends.
+        */
+        void startProgressThread (int intervalMicroseconds=50);
+
+        /**
+        Stop the progress thread, if it is running.
+        */
+        void stopProgressThread();
+
+        /**
+        Call MPI_Testsome once on the registered requests, from the calling
+        thread, and return the number that completed. This is a cooperative
+        alternative to the progress thread, to be called every so often from
+        long compute loops, and is safe to call while the thread runs.
+        */
+        static int progress();
     };
 }
 
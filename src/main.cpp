@@ -1,11 +1,18 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cassert>
+#include <cstring>
+#include <thread>
 
 #define COW_DEBUG_USE_CASSERT
 #include "Array.hpp"
 #include "MPI.hpp"
+#include "DistributedArray.hpp"
+#include "FFT.hpp"
 #include "HDF5.hpp"
+#include "AsyncWriter.hpp"
 #include "Timer.hpp"
 #include "DebugHelper.hpp"
 
@@ -27,6 +34,25 @@ void testHeap()
     assert (A.size() == 36);
     assert (B.size() == 0);
     assert (C.size() == 36);
+
+    // Copy-assigning to memory with its own deallocator keeps that memory,
+    // and refuses a block of a different size.
+    int numFreed = 0;
+    auto D = HeapAllocation (std::malloc (36), 36, [&] (void* memory) { std::free (memory); ++numFreed; });
+    auto address = D.begin();
+    D = A;
+    assert (D.begin() == address);
+
+    try
+    {
+        auto E = HeapAllocation (12);
+        D = E;
+        assert (false);
+    }
+    catch (std::logic_error&) {}
+
+    D = HeapAllocation();
+    assert (numFreed == 1);
 }
 
 
@@ -159,6 +185,345 @@ void testHdf5()
         assert (int_dset.getType().bytes() == sizeof (int));
         assert (dbl_dset.getType().bytes() == sizeof (double));
     }
+
+    {
+        auto A = Array (32, 32, 16);
+
+        for (int i = 0; i < 32; ++i)
+        for (int j = 0; j < 32; ++j)
+        for (int k = 0; k < 16; ++k)
+        {
+            A (i, j, k) = 0.25 * (i + j);
+        }
+
+        auto compressed = H5::PropertyList::DataSetCreate()
+        .setChunkAuto (A.getShapeVector(), {1, 32, 16})
+        .setShuffle()
+        .setDeflate (4)
+        .setFletcher32();
+
+        auto lossy = H5::PropertyList::DataSetCreate()
+        .setChunk ({8, 8, 16})
+        .setScaleOffset (2);
+
+        auto testFile = H5::File ("test.h5", "w");
+        auto dset = testFile.writeArray ("compressed", A, compressed);
+        testFile.writeArray ("lossy", A, lossy);
+
+        assert (dset.getStorageSize() < A.size() * sizeof (double) / 4);
+        assert (H5::PropertyList::DataSetCreate::isFilterAvailable (1));
+
+        auto B = testFile.readArray ("compressed");
+        auto C = testFile.readArray ("lossy");
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            assert (B[n] == A[n]);
+            assert (std::fabs (C[n] - A[n]) < 1e-2);
+        }
+    }
+
+    {
+        auto access = H5::PropertyList::FileAccess()
+        .setChunkCache (521, 4 << 20, 1.0)
+        .setAlignment (4096, 4096)
+        .setMetaBlockSize (1 << 16)
+        .setSieveBufferSize (1 << 18)
+        .setCoreDriver (1 << 16, false);
+
+        auto A = Array (64, 64);
+        A[0] = 1.5;
+
+        auto testFile = H5::File ("in_memory.h5", "w", access);
+        testFile.writeArray ("A", A, H5::PropertyList::DataSetCreate().setChunk ({16, 16}));
+
+        auto cache = H5::PropertyList::DataSetAccess().setChunkCache (101, 1 << 16);
+        auto dset = testFile.getDataSet ("A", cache);
+        assert (dset.readAll().getElement<double>(0) == 1.5);
+        assert (! std::ifstream ("in_memory.h5").good());
+    }
+
+    {
+        auto A = Array (4, 3, 2);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            A[n] = n;
+        }
+
+        auto testFile = H5::File ("test.h5", "w");
+        testFile.writeArray ("A", A);
+        testFile.writeVectorInt ("ints", {1, 2, 3});
+
+        auto B = Array (4, 3, 2);
+        testFile.readInto ("A", B);
+        assert (B (3, 2, 1) == A (3, 2, 1));
+
+        auto C = Array (6, 3, 2);
+        testFile.readInto ("A", C[Region().withRange (0, 2, 6)]);
+        assert (C (0, 0, 0) == 0);
+        assert (C (2, 0, 0) == A (0, 0, 0));
+        assert (C (5, 2, 1) == A (3, 2, 1));
+
+        auto values = std::vector<double> (A.size());
+        testFile.readInto ("A", values.data(), values.size());
+        assert (values.back() == A.size() - 1);
+        assert (testFile.readVectorInt ("ints")[2] == 3);
+
+        auto dset = testFile.getDataSet ("A");
+        auto D = Array (2, 3, 2);
+        dset[Region().withRange (0, 1, 3)].readInto (D);
+        assert (D (0, 0, 0) == A (1, 0, 0));
+        assert (D (1, 2, 1) == A (2, 2, 1));
+
+        try
+        {
+            testFile.readInto ("A", D);
+            assert (false);
+        }
+        catch (std::runtime_error&) {}
+    }
+
+    {
+        auto testFile = H5::File ("test.h5", "w");
+        auto names = std::vector<std::string>();
+
+        for (int n = 0; n < 3; ++n)
+        {
+            auto A = Array (4, 1, 2);
+            A (3, 0, 1) = n;
+            names.push_back ("field" + std::to_string (n));
+            testFile.writeArray (names.back(), A);
+        }
+
+        auto S = testFile.readArrays (names, 1);
+        auto T = testFile.readArrays (names, 1, Region().withRange (0, 2, 4));
+        assert (S.shape() == Shape ({{4, 3, 2, 1, 1}}));
+        assert (T.shape() == Shape ({{2, 3, 2, 1, 1}}));
+        assert (S (3, 2, 1) == 2);
+        assert (T (1, 1, 1) == 1);
+        assert (T (0, 1, 1) == 0);
+    }
+
+    {
+        auto testFile = H5::File ("test.h5", "w");
+
+        {
+            auto probe = testFile.appendTo ("probe", {}, 4);
+            auto tracers = testFile.appendTo ("tracers", {3, 2});
+            auto position = Array (3, 2);
+
+            for (int step = 0; step < 10; ++step)
+            {
+                position (2, 1) = step;
+                probe.append (0.5 * step);
+                tracers.append (position);
+            }
+            assert (probe.size() == 10);
+            assert (probe.getDataSet().getSpace().getShape()[0] == 8);
+            assert (probe.getDataSet().getSpace().getMaximumShape()[0] == -1);
+        }
+
+        {
+            auto tracers = testFile.appendTo ("tracers", {3, 2});
+            assert (tracers.size() == 10);
+            tracers.append (Array (3, 2));
+        }
+
+        auto probe = testFile.readVectorDouble ("probe");
+        auto tracers = testFile.readArray ("tracers");
+        assert (probe.size() == 10);
+        assert (probe[9] == 4.5);
+        assert (tracers.shape() == Shape ({{11, 3, 2, 1, 1}}));
+        assert (tracers (9, 2, 1) == 9);
+        assert (tracers (10, 2, 1) == 0);
+
+        // A data set with a fixed shape cannot be appended to. The error is
+        // raised by flush, and the destructor does not raise it again.
+        testFile.writeArray ("fixed", Array (2, 3));
+        {
+            auto fixed = testFile.appendTo ("fixed", {3});
+            fixed.append (Array (3));
+
+            try
+            {
+                fixed.flush();
+                assert (false);
+            }
+            catch (std::runtime_error&) {}
+        }
+
+        try
+        {
+            testFile.appendTo ("empty", {3, 0});
+            assert (false);
+        }
+        catch (std::logic_error&) {}
+    }
+
+    {
+        auto testFile = H5::File ("test.h5", "w");
+        auto parameters = testFile.createGroup ("parameters");
+        parameters.writeInt ("resolution", 128);
+        parameters.writeDouble ("cfl", 0.4);
+        parameters.writeString ("scheme", "plm");
+        testFile.writeArray ("density", Array (4, 2));
+
+        auto values = parameters.readNamedValues();
+        assert (values.size() == 3);
+        assert (int (values["resolution"]) == 128);
+        assert (std::string (values["scheme"]) == "plm");
+        assert (testFile.getGroupNames() == std::vector<std::string> ({"parameters"}));
+        assert (testFile.getDataSetNames() == std::vector<std::string> ({"density"}));
+
+        auto catalog = testFile.getCatalog (true);
+        assert (catalog.size() == 5);
+        assert (catalog[0].name == "density");
+        assert (catalog[0].kind == 'D');
+        assert (catalog[0].shape == std::vector<int> ({4, 2}));
+        assert (catalog[0].typeClass == 'f');
+        assert (catalog[1].kind == 'G');
+        assert (catalog[2].name == "parameters/cfl");
+        assert (catalog[3].typeClass == 'i');
+        assert (catalog[4].typeClass == 's');
+        assert (testFile.getCatalog().size() == 2);
+    }
+
+    {
+        // Arrays stored with reduced precision are converted back to double
+        // on reading. This one spans several conversion slabs.
+        auto A = Array (300, 64, 8);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            A[n] = std::sin (0.001 * n);
+        }
+        auto testFile = H5::File ("test.h5", "w");
+        auto single = testFile.writeArray ("single", A, H5::DataType::nativeFloat());
+        auto half = testFile.writeArray ("half", A, H5::DataType::float16());
+        testFile.writeArray ("corner", A[Region().withRange (0, 0, 2)], H5::DataType::float16());
+
+        assert (single.getStorageSize() == A.size() * sizeof (float));
+        assert (half.getStorageSize() == A.size() * 2u);
+
+        auto B = testFile.readArray ("single");
+        auto C = testFile.readArray ("half");
+        auto D = testFile.readArray ("corner");
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            assert (std::fabs (B[n] - A[n]) < 1e-7);
+            assert (std::fabs (C[n] - A[n]) < 1e-3);
+        }
+        for (int n = 0; n < D.size(); ++n)
+        {
+            assert (D[n] == C[n]);
+        }
+
+        // E[5] is just above half way between two halves, but rounding it
+        // to a float first would land exactly half way, and then round down.
+        auto E = Array (8);
+        E[0] = 1.0;
+        E[1] = 65504.0;
+        E[2] = 1e6;
+        E[3] = -std::ldexp (1.0, -24);
+        E[4] = 1.0 + std::ldexp (1.0, -11);
+        E[5] = 1.0 + std::ldexp (1.0, -11) + std::ldexp (1.0, -40);
+        E[6] = 65520.0;
+        E[7] = std::nan ("");
+        testFile.writeArray ("extremes", E, H5::DataType::float16());
+        auto F = testFile.readArray ("extremes");
+        assert (F[0] == 1.0);
+        assert (F[1] == 65504.0);
+        assert (std::isinf (F[2]));
+        assert (F[3] == -std::ldexp (1.0, -24));
+        assert (F[4] == 1.0);
+        assert (F[5] == 1.0 + std::ldexp (1.0, -10));
+        assert (std::isinf (F[6]));
+        assert (std::isnan (F[7]));
+    }
+
+    {
+        // Blocks of uneven size, each in its own file, are read back through
+        // one virtual data set.
+        auto A = Array (6, 5);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            A[n] = n;
+        }
+        auto sources = std::vector<H5::Location::VirtualSource>();
+        int block = 0;
+
+        for (auto rows : {std::make_pair (0, 4), std::make_pair (4, 6)})
+        for (auto cols : {std::make_pair (0, 2), std::make_pair (2, 5)})
+        {
+            auto fileName = "block." + std::to_string (block++) + ".h5";
+            auto region = Region().withRange (0, rows.first, rows.second).withRange (1, cols.first, cols.second);
+            H5::File (fileName, "w").writeArray ("data", A[region]);
+            sources.push_back ({fileName, "data", region});
+        }
+
+        // A source with an empty range must not be mapped over the whole
+        // axis, where it would override the sources before it.
+        H5::File ("block.empty.h5", "w").writeArray ("data", Array (6, 5));
+        sources.push_back ({"block.empty.h5", "data", Region().withRange (0, 0, 0)});
+        {
+            auto testFile = H5::File ("test.h5", "w");
+            testFile.createVirtualDataSet ("assembled", A.getShapeVector(), sources);
+        }
+        auto testFile = H5::File ("test.h5", "r");
+        auto B = testFile.readArray ("assembled");
+        auto C = Array (3, 2);
+        testFile.getDataSet ("assembled")[Region().withRange (0, 2, 5).withRange (1, 1, 3)].readInto (C);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            assert (B[n] == A[n]);
+        }
+        assert (C (0, 0) == A (2, 1));
+        assert (C (2, 1) == A (4, 2));
+    }
+}
+
+
+void testAsyncWriter()
+{
+    auto A = Array (16, 16, 4);
+    auto C = Array (2);
+
+    {
+        AsyncWriter writer (1);
+
+        for (int step = 0; step < 4; ++step)
+        {
+            for (auto& x : A)
+            {
+                x = step;
+            }
+
+            auto snapshot = writer.beginSnapshot ("async." + std::to_string (step) + ".h5");
+            snapshot.add ("A", A);
+            snapshot.add ("B", C);
+            writer.submit (std::move (snapshot));
+            assert (writer.getNumPending() <= 1);
+
+            // The snapshot holds its own copy, so A may change right away.
+            A[0] = -1;
+        }
+        writer.flush();
+        assert (writer.getNumPending() == 0);
+    }
+
+    for (int step = 0; step < 4; ++step)
+    {
+        auto file = H5::File ("async." + std::to_string (step) + ".h5");
+        auto B = file.readArray ("A");
+        assert (B.shape() == A.shape());
+        assert (B[0] == step);
+        assert (B[B.size() - 1] == step);
+        assert (file.readArray ("B").size (0) == 2);
+    }
 }
 
 
@@ -214,19 +579,749 @@ void testSlicing()
             last = &it;
         }
     }
+
+    {
+        auto A = Array (6, 5, 4, 3);
+        auto B = Array (A.shape());
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            A[n] = n;
+        }
+
+        for (auto R : {
+            Region(),
+            Region().withRange (0, 2, 4),
+            Region().withRange (2, 1, -1).withRange (3, 1, 2),
+            Region().withStride (0, 2).withRange (1, 1, 5, 3) })
+        {
+            auto buffer = std::vector<double> (R.absolute (A.shape()).size());
+            A.packRegion (R, &buffer[0]);
+            B.unpackRegion (R, &buffer[0], 4);
+
+            auto extracted = A.extract (R.absolute (A.shape()));
+
+            for (unsigned int n = 0; n < buffer.size(); ++n)
+            {
+                assert (extracted[n] == buffer[n]);
+            }
+            for (auto& x : B[R])
+            {
+                assert (x == A[&x - B.begin()]);
+            }
+        }
+    }
+}
+
+
+void testMpi()
+{
+    auto world = MpiCommunicator::world();
+    auto cart = world.createCartesian (1);
+
+    {
+        // Exchange a single component (strided on axis 3) and every other
+        // cell (strided on axis 0). Every rank holds the same data, so the
+        // result does not depend on the number of processes.
+        auto A = Array (8, 1, 1, 3);
+
+        for (int i = 0; i < 8; ++i)
+        for (int m = 0; m < 3; ++m)
+        {
+            A (i, 0, 0, m) = 10 * i + m;
+        }
+
+        auto send = Region().withRange (0, 4, 8, 2).withRange (3, 1, 2);
+        auto recv = Region().withRange (0, 0, 4, 2).withRange (3, 1, 2);
+        cart.shiftExchange (A, 0, 'R', send, recv);
+
+        assert (A (0, 0, 0, 1) == 41);
+        assert (A (2, 0, 0, 1) == 61);
+        assert (A (1, 0, 0, 1) == 11);
+        assert (A (0, 0, 0, 0) == 0);
+        assert (A (0, 0, 0, 2) == 2);
+
+        // The same exchange through packed buffers must give the same result.
+        auto B = A;
+        cart.setExchangeMode (MpiCartComm::ExchangeMode::packed);
+        cart.shiftExchange (B, 0, 'R', recv, send);
+        cart.setExchangeMode (MpiCartComm::ExchangeMode::automatic);
+        cart.shiftExchange (A, 0, 'R', recv, send);
+        cart.setExchangeMode (MpiCartComm::ExchangeMode::datatype);
+
+        assert (B (4, 0, 0, 1) == 41);
+        assert (B (6, 0, 0, 1) == 61);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            assert (A[n] == B[n]);
+        }
+
+        // Neighbors on the same node load directly from each other's shared
+        // memory windows.
+        auto C = cart.allocateShared (A.shape());
+        C = A;
+        assert (cart.isSharedAllocation (C));
+        assert (! cart.isSharedAllocation (A));
+
+        // Or put directly into each other's RMA windows, with either kind of
+        // synchronization.
+        auto W = cart.allocateWindow (A.shape());
+        auto V = cart.allocateWindow (A.shape());
+        W = A;
+        V = A;
+        assert (cart.isWindowAllocation (W));
+        assert (! cart.isWindowAllocation (C));
+
+        cart.shiftExchange (A, 0, 'R', send, recv);
+        cart.setExchangeMode (MpiCartComm::ExchangeMode::sharedMemory);
+        cart.shiftExchange (C, 0, 'R', send, recv);
+        cart.setExchangeMode (MpiCartComm::ExchangeMode::rmaFence);
+        cart.shiftExchange (W, 0, 'R', send, recv);
+        cart.setExchangeMode (MpiCartComm::ExchangeMode::rmaPscw);
+        cart.shiftExchange (V, 0, 'R', send, recv);
+        cart.setExchangeMode (MpiCartComm::ExchangeMode::datatype);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            assert (A[n] == C[n]);
+            assert (A[n] == W[n]);
+            assert (A[n] == V[n]);
+        }
+    }
+
+    {
+        // Payloads of different sizes come back on the master in rank order.
+        auto payloads = world.gatherInOrder (HeapAllocation (std::string (world.rank(), 'a' + world.rank() % 26)));
+        assert (int (payloads.size()) == (world.isThisMaster() ? world.size() : 0));
+
+        for (unsigned int n = 0; n < payloads.size(); ++n)
+        {
+            assert (payloads[n].toString() == std::string (n, 'a' + n % 26));
+        }
+
+        auto stream = std::ostringstream();
+        auto expected = std::string();
+        world.inSequence (stream, [] (int rank, std::ostream& output) { output << rank << ";"; });
+
+        for (int n = 0; n < world.size() && world.isThisMaster(); ++n)
+        {
+            expected += std::to_string (n) + ";";
+        }
+        assert (stream.str() == expected);
+    }
+
+    if (MpiSession::getThreadSupport() == MpiSession::ThreadSupport::multiple)
+    {
+        // Each thread exchanges its own array through its own duplicate.
+        auto duplicates = cart.duplicateForThreads (2);
+        auto arrays = std::vector<Array> (2, Array (8, 3));
+        auto threads = std::vector<std::thread>();
+
+        for (int t = 0; t < 2; ++t)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                arrays[t] (i, 1) = 100 * t + i;
+            }
+            threads.push_back (std::thread ([&, t] ()
+            {
+                auto send = Region().withRange (0, 6, 7).withRange (1, 1, 2);
+                auto recv = Region().withRange (0, 0, 1).withRange (1, 1, 2);
+                duplicates[t].shiftExchange (arrays[t], 0, 'R', send, recv);
+            }));
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        assert (arrays[0] (0, 1) == 6);
+        assert (arrays[1] (0, 1) == 106);
+    }
+
+    {
+        auto A = Array (4, 4, 2);
+        auto B = Array (2, 2);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            A[n] = n;
+        }
+
+        auto R = Region().withStride (0, 2).withStride (1, 2).withRange (2, 1, 2);
+        auto request = world.request (B, Region(), world.rank());
+        world.send (A, R, world.rank());
+        request.wait();
+
+        assert (B (0, 0) == A (0, 0, 1));
+        assert (B (1, 1) == A (2, 2, 1));
+    }
+
+    {
+        using Reduction = MpiCommunicator::Reduction;
+        const int P = world.size();
+        const int r = world.rank();
+
+        auto A = Array (3);
+        A[0] = 1;
+        A[1] = r;
+        A[2] = -r;
+        world.allreduce (A, Reduction::sum);
+        assert (A[0] == P);
+        assert (A[1] == P * (P - 1) / 2);
+
+        auto B = Array (2);
+        B[0] = r;
+        B[1] = -r;
+        auto request = world.postAllreduce (B, Reduction::maximum);
+        request.wait();
+        assert (B[0] == P - 1);
+        assert (B[1] == 0);
+
+        auto batch = MpiReductionBatch (world);
+        auto i0 = batch.add (r, Reduction::minimum);
+        auto i1 = batch.add (r, Reduction::maximum);
+        auto i2 = batch.add (B, Reduction::sum);
+        batch.reduce();
+
+        assert (batch.size() == 4);
+        assert (batch.getResult (i0) == 0);
+        assert (batch.getResult (i1) == P - 1);
+        assert (batch.getResult (i2) == P * (P - 1));
+        assert (batch.getResult (i2 + 1) == 0);
+
+        for (int size : {3, 1, 40})
+        {
+            auto C = Array (size);
+
+            for (int n = 0; n < size; ++n)
+            {
+                C[n] = r + n;
+            }
+            world.allreduceHierarchical (C, Reduction::sum);
+            assert (C[size - 1] == P * (P - 1) / 2 + P * (size - 1));
+        }
+
+        auto hierarchical = world.duplicate();
+        hierarchical.setHierarchicalReductions (true);
+        assert (hierarchical.minimum (r) == 0);
+        assert (hierarchical.maximum (r) == P - 1);
+        assert (hierarchical.sum ({1.0, double (r)})[1] == P * (P - 1) / 2);
+
+        // Counts beyond 2^53 are summed exactly.
+        const long big = (1L << 53) + 1;
+        assert (world.sum (big) == P * big);
+    }
+
+    for (auto method : {MpiCommunicator::SparseExchange::nbx, MpiCommunicator::SparseExchange::alltoallv})
+    {
+        const int P = world.size();
+        const int r = world.rank();
+        auto outgoing = std::map<int, HeapAllocation>();
+        auto message = std::string ("from ") + std::to_string (r);
+
+        if (P > 2)
+        {
+            outgoing[(r + 2) % P] = HeapAllocation (0);
+        }
+        outgoing[(r + 1) % P] = HeapAllocation (message);
+
+        auto incoming = world.exchangeSparse (outgoing, method);
+        auto expected = std::string ("from ") + std::to_string ((r + P - 1) % P);
+        auto& payload = incoming.at ((r + P - 1) % P);
+
+        assert (int (incoming.size()) == (P > 2 ? 2 : 1));
+        assert (payload.size() == expected.size());
+        assert (std::memcmp (payload.begin(), expected.data(), expected.size()) == 0);
+        assert (P <= 2 || incoming.at ((r + P - 2) % P).size() == 0);
+    }
+
+    {
+        // Back-to-back exchanges, with a different partner and payload each
+        // round, must not receive each other's messages.
+        const int P = world.size();
+        const int r = world.rank();
+
+        for (int round = 0; round < 3000; ++round)
+        {
+            auto outgoing = std::map<int, HeapAllocation>();
+            auto message = HeapAllocation ((round % 7 + 2) * sizeof (int));
+            message.getElement<int> (0) = round;
+            message.getElement<int> (1) = r;
+            outgoing[(r + 1 + round) % P] = std::move (message);
+
+            auto incoming = world.exchangeSparse (outgoing);
+            auto source = ((r - 1 - round) % P + P) % P;
+
+            assert (incoming.size() == 1);
+            assert (incoming.at (source).size() == (round % 7 + 2) * sizeof (int));
+            assert (incoming.at (source).getElement<int> (0) == round);
+            assert (incoming.at (source).getElement<int> (1) == source);
+        }
+    }
+}
+
+
+void testDistributedArray()
+{
+    // Every block must be at least as wide as the widest ghost layer (two
+    // cells, below), however many processes share an axis.
+    auto world = MpiCommunicator::world();
+    const int N = 3 * 2 * world.size();
+    auto global = Array (N, N, N);
+    auto D = DistributedArray (world.createCartesian (3), global.shape(), 1);
+
+    for (int n = 0; n < global.size(); ++n)
+    {
+        global[n] = n;
+    }
+
+    D.write (Region(), global);
+    D.exchangeGhosts();
+
+    auto& L = D.getLocalArray();
+    auto G = D.getGlobalRegion();
+    assert (L (0, 1, 1) == global ((G.lower[0] + N - 1) % N, G.lower[1], G.lower[2]));
+
+    // The ghost layers on the last axis are one cell wide, so their send and
+    // receive regions have size 1 there, at a non-zero start.
+    assert (L (1, 1, 0) == global (G.lower[0], G.lower[1], (G.lower[2] + N - 1) % N));
+    assert (L (1, 1, L.size (2) - 1) == global (G.lower[0], G.lower[1], G.upper[2] % N));
+
+    auto R = Region().withRange (0, 1, N - 1).withRange (1, 2, 3);
+    auto A = D.read (R);
+    assert (A.shape() == R.absolute (global.shape()).shape());
+    assert (A (0, 0, 0) == global (1, 2, 0));
+    assert (A (N - 3, 0, N - 1) == global (N - 2, 2, N - 1));
+
+    assert (D.minimum() == 0);
+    assert (D.maximum() == global.size() - 1);
+    assert (D.sum() == 0.5 * global.size() * (global.size() - 1));
+
+    auto E = D.redistribute (world.createCartesian (1), 2);
+    auto B = E.read (Region());
+
+    for (int n = 0; n < global.size(); ++n)
+    {
+        assert (B[n] == global[n]);
+    }
+
+    for (auto mode : {
+        MpiCartComm::ExchangeMode::sharedMemory,
+        MpiCartComm::ExchangeMode::rmaFence,
+        MpiCartComm::ExchangeMode::rmaPscw})
+    {
+        auto windowComm = world.createCartesian (3);
+        windowComm.setExchangeMode (mode);
+        auto S = DistributedArray (windowComm, global.shape(), 1);
+        S.write (Region(), global);
+        S.exchangeGhosts();
+        assert (windowComm.canExchange (S.getLocalArray()));
+
+        for (int n = 0; n < L.size(); ++n)
+        {
+            assert (S.getLocalArray()[n] == L[n]);
+        }
+    }
+
+    auto placed = DistributedArray (world.createCartesian (3, {}, true), global.shape(), 1);
+    placed.write (Region(), global);
+    B = placed.read (Region());
+    assert (placed.getInterNodeHaloVolume() == 0);
+
+    for (int n = 0; n < global.size(); ++n)
+    {
+        assert (B[n] == global[n]);
+    }
+
+    auto pencils = DistributedArray (world.createCartesian (3, {true, true, false}), global.shape());
+
+    for (auto method : {
+        MpiRedistributionPlan::Method::alltoallw,
+        MpiRedistributionPlan::Method::alltoallv,
+        MpiRedistributionPlan::Method::pipelined})
+    {
+        for (auto& x : pencils.getLocalArray())
+        {
+            x = -1;
+        }
+        auto plan = D.planRedistribution (pencils, method, 2);
+        plan.execute (D.getLocalArray(), pencils.getLocalArray());
+        assert (pencils.getLocalArray().size (2) == global.size (2));
+        B = pencils.read (Region());
+
+        for (int n = 0; n < global.size(); ++n)
+        {
+            assert (B[n] == global[n]);
+        }
+    }
+
+    // Weight the cells so the cost is concentrated at small i, and check
+    // that the data survives rebalancing.
+    auto cellWeights = global.map ([&] (double x) { return x < global.size() / 4 ? 10.0 : 1.0; });
+    auto weights = DistributedArray (E.getCommunicator(), global.shape());
+    weights.write (Region(), cellWeights);
+
+    auto maximumBlockCost = [&] (const std::vector<int>& bounds)
+    {
+        double maximum = 0;
+
+        for (unsigned int c = 0; c + 1 < bounds.size(); ++c)
+        {
+            double cost = 0;
+
+            for (auto x : cellWeights[Region().withRange (0, bounds[c], bounds[c + 1])])
+            {
+                cost += x;
+            }
+            maximum = std::max (maximum, cost);
+        }
+        return maximum;
+    };
+
+    auto bounds = E.balancedBounds (weights);
+    assert (bounds.size() == 1);
+    assert (bounds[0].front() == 0);
+    assert (bounds[0].back() == N);
+    assert (std::is_sorted (bounds[0].begin(), bounds[0].end()));
+    assert (world.size() == 1 || maximumBlockCost (bounds[0]) < maximumBlockCost (E.getBlockBounds()[0]));
+
+    E.rebalance (bounds);
+    assert (E.getBlockBounds() == bounds);
+    assert (E.sum() == D.sum());
+    B = E.read (Region());
+
+    for (int n = 0; n < global.size(); ++n)
+    {
+        assert (B[n] == global[n]);
+    }
+
+    // Narrow the last block and widen the one before it, so that the master
+    // keeps its block while its left neighbor's changes. The RMA exchanges
+    // must learn the neighbor's new receive region.
+    for (auto mode : {
+        MpiCartComm::ExchangeMode::rmaFence,
+        MpiCartComm::ExchangeMode::rmaPscw})
+    {
+        if (world.size() == 1)
+        {
+            break;
+        }
+        auto windowComm = world.createCartesian (1);
+        windowComm.setExchangeMode (mode);
+        auto S = DistributedArray (windowComm, global.shape(), 1);
+        S.write (Region(), global);
+        S.exchangeGhosts();
+
+        auto shifted = S.getBlockBounds();
+        shifted[0][world.size() - 1] += 1;
+        S.rebalance (shifted);
+        S.exchangeGhosts();
+
+        auto& M = S.getLocalArray();
+        auto H = S.getGlobalRegion();
+        assert (M (0, 0, 0) == global ((H.lower[0] + N - 1) % N, 0, 0));
+        assert (M (M.size (0) - 1, 0, 0) == global (H.upper[0] % N, 0, 0));
+    }
+
+    // Write one decomposition and read it back into another, through a
+    // shared file if the HDF5 library supports it.
+    auto openShared = [&] (const char* mode)
+    {
+        return H5::File::isParallelSupported() ? H5::File ("distributed.h5", mode, world) : H5::File ("distributed.h5", mode);
+    };
+
+    if (! H5::File::isParallelSupported())
+    {
+        try
+        {
+            H5::File ("distributed.h5", "w", world);
+            assert (false);
+        }
+        catch (std::runtime_error&) {}
+    }
+
+    if (H5::File::isParallelSupported() || world.size() == 1)
+    {
+        openShared ("w").writeDistributedArray ("global", D);
+        auto restarted = DistributedArray (world.createCartesian (3, {true, true, false}), global.shape(), 1);
+        openShared ("r").readDistributedArray ("global", restarted);
+        assert (restarted.sum() == D.sum());
+        assert (restarted.read (Region()) (N - 1, N - 2, 3) == global (N - 1, N - 2, 3));
+    }
+
+    // Write one file per process, and assemble them into a virtual data set.
+    // The files are distinct, so the processes write them at once; the
+    // barrier in onMasterOnly keeps them from being read too soon.
+    auto blockFileName = [] (int rank) { return "block." + std::to_string (rank) + ".h5"; };
+    H5::File (blockFileName (world.rank()), "w").writeArray ("block", D.getLocalArray()[D.getInterior()]);
+    world.onMasterOnly ([&]
+    {
+        H5::File ("assembled.h5", "w").createVirtualDataSet ("global", D, blockFileName, "block");
+    });
+    B = H5::File ("assembled.h5", "r").readArray ("global");
+
+    for (int n = 0; n < global.size(); ++n)
+    {
+        assert (B[n] == global[n]);
+    }
+
+    if (world.size() > 1)
+    {
+        // The master owns the empty block [0, 0), whose file holds an empty
+        // data set; it must not be mapped as a region covering the whole axis.
+        auto bounds = std::vector<int> {0};
+        auto line = Array (4 * (world.size() - 1));
+
+        for (int c = 0; c < world.size(); ++c)
+        {
+            bounds.push_back (4 * c);
+        }
+        for (int n = 0; n < line.size(); ++n)
+        {
+            line[n] = n + 1;
+        }
+        auto U = DistributedArray (world.createCartesian (1), line.shape(), {bounds});
+        auto lineFileName = [] (int rank) { return "line." + std::to_string (rank) + ".h5"; };
+        U.write (Region(), line);
+
+        H5::File (lineFileName (world.rank()), "w").writeArray ("block", U.getLocalArray());
+        world.onMasterOnly ([&]
+        {
+            H5::File ("assembled.h5", "w").createVirtualDataSet ("line", U, lineFileName, "block");
+        });
+        auto C = H5::File ("assembled.h5", "r").readArray ("line");
+
+        for (int n = 0; n < line.size(); ++n)
+        {
+            assert (C[n] == line[n]);
+        }
+    }
+}
+
+
+void testFFT()
+{
+    const double pi = 4 * std::atan (1.0);
+
+    for (int N : {1, 12, 15, 16, 20})
+    {
+        auto A = Array (N, 1, 1, 1, 2);
+
+        for (int i = 0; i < N; ++i)
+        {
+            A (i, 0, 0, 0, 0) = std::cos (i * i + 1.0);
+            A (i, 0, 0, 0, 1) = std::sin (3.0 * i);
+        }
+
+        auto B = A;
+        FFT::forward (B, 0);
+
+        for (int k = 0; k < N; ++k)
+        {
+            auto X = std::complex<double>();
+
+            for (int i = 0; i < N; ++i)
+            {
+                X += std::complex<double> (A (i, 0, 0, 0, 0), A (i, 0, 0, 0, 1)) * std::polar (1.0, -2 * pi * i * k / N);
+            }
+            assert (std::abs (X.real() - B (k, 0, 0, 0, 0)) < 1e-10);
+            assert (std::abs (X.imag() - B (k, 0, 0, 0, 1)) < 1e-10);
+        }
+
+        FFT::inverse (B, 0);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            assert (std::abs (A[n] - B[n]) < 1e-12);
+        }
+    }
+
+    {
+        // Transform along every axis, including the last, where sequences
+        // are not interleaved, against a direct sum.
+        auto A = Array (5, 9, 6, 3, 2);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            A[n] = std::cos (n * n + 1.0);
+        }
+
+        for (int axis = 0; axis < 4; ++axis)
+        {
+            auto B = A;
+            FFT::forward (B, axis);
+
+            for (auto index : {std::vector<int> {4, 8, 5, 2}, std::vector<int> {0, 3, 1, 1}})
+            {
+                const int N = A.size (axis);
+                auto X = std::complex<double>();
+                auto i = index;
+
+                for (i[axis] = 0; i[axis] < N; ++i[axis])
+                {
+                    auto x = std::complex<double> (A (i[0], i[1], i[2], i[3], 0), A (i[0], i[1], i[2], i[3], 1));
+                    X += x * std::polar (1.0, -2 * pi * i[axis] * index[axis] / N);
+                }
+                assert (std::abs (X.real() - B (index[0], index[1], index[2], index[3], 0)) < 1e-10);
+                assert (std::abs (X.imag() - B (index[0], index[1], index[2], index[3], 1)) < 1e-10);
+            }
+
+            FFT::inverse (B, axis);
+
+            for (int n = 0; n < A.size(); ++n)
+            {
+                assert (std::abs (A[n] - B[n]) < 1e-12);
+            }
+        }
+    }
+
+    for (int N : {9, 10})
+    {
+        auto A = Array (3, N, 2);
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            A[n] = std::cos (n * n + 2.0);
+        }
+
+        auto R = FFT::forwardReal (A, 1);
+        auto C = FFT::toComplex (A);
+        FFT::forward (C, 1);
+        assert (R.size (1) == N / 2 + 1);
+        assert (std::abs (R (2, 3, 1, 0, 1) - C (2, 3, 1, 0, 1)) < 1e-10);
+
+        auto B = FFT::inverseReal (R, 1, N);
+        assert (B.shape() == A.shape());
+
+        for (int n = 0; n < A.size(); ++n)
+        {
+            assert (std::abs (A[n] - B[n]) < 1e-12);
+        }
+    }
+
+    auto world = MpiCommunicator::world();
+    auto global = Array (8, 6, 4, 1, 2);
+
+    for (int n = 0; n < global.size(); ++n)
+    {
+        global[n] = std::cos (n * n + 3.0);
+    }
+
+    for (auto decomposition : {DistributedFFT::Decomposition::slabs, DistributedFFT::Decomposition::pencils})
+    {
+        auto D = DistributedArray (world.createCartesian (3), global.shape(), 1);
+        D.write (Region(), global);
+
+        auto fft = DistributedFFT (D, decomposition);
+        auto F = fft.forward (D);
+        auto expected = global;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            FFT::forward (expected, axis);
+        }
+
+        auto spectrum = F.read (Region());
+
+        for (int n = 0; n < global.size(); ++n)
+        {
+            assert (std::abs (spectrum[n] - expected[n]) < 1e-9);
+        }
+
+        auto P = fft.powerSpectrum (F, 8);
+        double total = 0;
+        double binned = 0;
+
+        for (int n = 0; n < expected.size(); ++n)
+        {
+            total += expected[n] * expected[n];
+        }
+        for (int n = 0; n < P.size(); ++n)
+        {
+            binned += P[n];
+        }
+        assert (std::abs (binned - total) < 1e-8 * total);
+
+        auto E = fft.inverse (F);
+        auto back = E.read (Region());
+
+        for (int n = 0; n < global.size(); ++n)
+        {
+            assert (std::abs (back[n] - global[n]) < 1e-12);
+        }
+    }
+}
+
+
+void testProgress (MpiSession& mpi)
+{
+    auto world = MpiCommunicator::world();
+    auto A = Array (1 << 16);
+    auto B = Array (1 << 16);
+    A[123] = 1.0;
+
+    // Requests registered for progress are driven by explicit polling...
+    {
+        auto recv = world.request (B, Region(), world.rank(), 7);
+        auto send = world.post (A, Region(), world.rank(), 7);
+        recv.enableProgress();
+        send.enableProgress();
+
+        while (! recv.getStatus())
+        {
+            MpiSession::progress();
+        }
+        assert (recv.test());
+        send.wait();
+        assert (B[123] == 1.0);
+    }
+
+    if (MpiSession::getThreadSupport() != MpiSession::ThreadSupport::multiple)
+    {
+        return;
+    }
+
+    // ...or by the session's progress thread, while this thread computes.
+    A[123] = 2.0;
+    mpi.startProgressThread();
+    {
+        auto recv = world.request (B, Region(), world.rank(), 8);
+        auto send = world.post (A, Region(), world.rank(), 8);
+        recv.enableProgress();
+        send.enableProgress();
+
+        while (! recv.getStatus())
+        {
+            std::this_thread::yield();
+        }
+        recv.wait();
+        send.wait();
+        assert (B[123] == 2.0);
+    }
+    mpi.stopProgressThread();
 }
 
 
 int main (int argc, const char* argv[])
 {
-    MpiSession mpi;
+    MpiSession mpi (0, nullptr, MpiSession::ThreadSupport::multiple);
     // std::set_terminate (Cow::terminateWithBacktrace);
 
+    // The HDF5 tests write files of fixed names, which serial HDF5 locks,
+    // so only one process runs them.
+    auto world = MpiCommunicator::world();
+
     testHeap();
     testArray();
-    testHdf5();
+    world.onMasterOnly (testHdf5);
+    world.onMasterOnly (testAsyncWriter);
     testIter();
     testSlicing();
+    testMpi();
+    testDistributedArray();
+    testProgress (mpi);
+    testFFT();
 
     return 0;
 }